@@ -1,19 +1,41 @@
+#include <linux/atomic.h>
+#include <linux/bvec.h>
 #include <linux/cdev.h>
+#include <linux/crc32.h>
+#include <linux/crc32c.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
 #include <linux/fcntl.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/init.h>
 #include <linux/ioctl.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
 #include <linux/kdev_t.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/namei.h>
+#include <linux/pagemap.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
 #include <linux/semaphore.h>
 #include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/shrinker.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
 
 #include "scull.h"
 
@@ -27,14 +49,91 @@ enum {
   SCULL_IOC_NR_SET_QUANTUM,
   SCULL_IOC_NR_GET_QSET,
   SCULL_IOC_NR_SET_QSET,
+  SCULL_IOC_NR_GET_MEM_LIMIT,
+  SCULL_IOC_NR_SET_MEM_LIMIT,
+  SCULL_IOC_NR_GET_MEM_BLOCK,
+  SCULL_IOC_NR_SET_MEM_BLOCK,
+  SCULL_IOC_NR_GET_SIZE,
+  SCULL_IOC_NR_KV_PUT,
+  SCULL_IOC_NR_KV_GET,
+  SCULL_IOC_NR_KV_DELETE,
+  SCULL_IOC_NR_KV_MULTI_GET,
+  SCULL_IOC_NR_SNAPSHOT,
+  SCULL_IOC_NR_CHECKSUM,
   SCULL_IOC_NR_LAST,
 };
 
+// Argument of SCULL_IOC_CHECKSUM, for nr quanta from the one holding pos.
+// Checksums are crc32c with seed 0 and no final xor of whole quanta, holes
+// included. range_crc is the checksum of all of them in a row. With
+// SCULL_CSUM_VERIFY, the quanta are also hashed again in the kernel, and
+// mismatches are counted in nr_bad. nr is set to the number of quanta below
+// the device size.
+struct scull_csum_req {
+  __u64 pos;
+  __u64 crcs;
+  __u32 nr;
+  __u32 flags;
+  __u32 quantum;
+  __u32 range_crc;
+  __u32 nr_bad;
+  __u32 reserved;
+  __u64 first_bad;
+};
+
+#define SCULL_CSUM_VERIFY 1
+
+// Argument of the key-value ioctls, key and value are user pointers. GET
+// sets value_len to the length of the value and fails with EMSGSIZE if it
+// is longer than the value_len passed in. MULTI_GET reports errors in
+// status instead.
+struct scull_kv_req {
+  __u64 key;
+  __u64 value;
+  __u32 key_len;
+  __u32 value_len;
+  __s32 status;
+  __u32 reserved;
+};
+
+struct scull_kv_batch {
+  __u64 reqs;
+  __u32 nr;
+  __u32 reserved;
+};
+
+// An O_APPEND write or KV_PUT value that failed, or whose writer was killed
+// while waiting to publish it, still takes its place in the log, as a hole
+// record: a struct scull_log_hole at its start if the range is at least that
+// long, and zeros in the rest. Parts of the range that couldn't be allocated
+// read as zeros too. A positional write past the end of the log takes its
+// range from the appenders, and fails with EBUSY while appends are in flight.
+struct scull_log_hole {
+  __u32 magic;
+  __u32 reserved;
+  __u64 len;
+};
+
+#define SCULL_LOG_HOLE_MAGIC 0x484c4353
+
 #define SCULL_IOC_RESET_QUANTUM_QSET  _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_RESET_QUANTUM_QSET)
 #define SCULL_IOC_GET_QUANTUM _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_QUANTUM)
 #define SCULL_IOC_SET_QUANTUM _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_QUANTUM)
 #define SCULL_IOC_GET_QSET    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_QSET)
 #define SCULL_IOC_SET_QSET    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_QSET)
+// The quota of the device, see scull_mem_limit. Setting it needs a file open
+// for writing and CAP_SYS_RESOURCE.
+#define SCULL_IOC_GET_MEM_LIMIT _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_MEM_LIMIT)
+#define SCULL_IOC_SET_MEM_LIMIT _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_MEM_LIMIT)
+#define SCULL_IOC_GET_MEM_BLOCK _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_MEM_BLOCK)
+#define SCULL_IOC_SET_MEM_BLOCK _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_MEM_BLOCK)
+#define SCULL_IOC_GET_SIZE    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_SIZE)
+#define SCULL_IOC_KV_PUT      _IOW(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_PUT, struct scull_kv_req)
+#define SCULL_IOC_KV_GET      _IOWR(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_GET, struct scull_kv_req)
+#define SCULL_IOC_KV_DELETE   _IOW(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_DELETE, struct scull_kv_req)
+#define SCULL_IOC_KV_MULTI_GET _IOWR(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_MULTI_GET, struct scull_kv_batch)
+#define SCULL_IOC_SNAPSHOT    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SNAPSHOT)
+#define SCULL_IOC_CHECKSUM    _IOWR(SCULL_IOC_MAGIC, SCULL_IOC_NR_CHECKSUM, struct scull_csum_req)
 
 #define SCULL_QUANTUM   1024
 #define SCULL_QSET      1024
@@ -47,17 +146,227 @@ module_param(scull_major, uint, S_IRUGO);
 module_param(scull_qset, uint, S_IRUGO);
 module_param(scull_quantum, uint, S_IRUGO);
 
+// Compress quanta that haven't been accessed for scull_cold_secs seconds.
+bool scull_compress = false;
+char* scull_compress_alg = "lz4";
+unsigned scull_cold_secs = 30;
+
+module_param(scull_compress, bool, S_IRUGO);
+module_param(scull_compress_alg, charp, S_IRUGO);
+module_param(scull_cold_secs, uint, S_IRUGO);
+
+// When scull_spill_file is set, least recently used quanta are written to it
+// when resident quanta exceed scull_mem_budget bytes (0 means no budget), or
+// when the kernel asks the shrinker to reclaim memory.
+char* scull_spill_file = NULL;
+unsigned long scull_mem_budget = 0;
+
+module_param(scull_spill_file, charp, S_IRUGO);
+module_param(scull_mem_budget, ulong, S_IRUGO);
+
+// Default per-device limit of bytes of quanta in memory (0 means no limit).
+// When the limit is reached, writes fail with -ENOSPC, or wait for memory
+// to be freed if scull_mem_block is set.
+unsigned long scull_mem_limit = 0;
+bool scull_mem_block = false;
+
+module_param(scull_mem_limit, ulong, S_IRUGO);
+module_param(scull_mem_block, bool, S_IRUGO);
+
+// Every scull_compact_secs seconds, drop quanta holding only zeros, and free
+// qset arrays and trailing qsets which hold nothing (0 means never).
+unsigned scull_compact_secs = 60;
+
+module_param(scull_compact_secs, uint, S_IRUGO);
+
+// Allocate quanta for a write before taking dev->sem. Turn it off to compare
+// the write lock hold time histogram in /proc/scull_device.
+bool scull_write_prealloc = true;
+
+module_param(scull_write_prealloc, bool, S_IRUGO);
+
+// Image file loaded into the device at init by scull_image_workers parallel
+// readers, and written back by SCULL_IOC_SNAPSHOT.
+char* scull_image = NULL;
+unsigned scull_image_workers = 4;
+
+module_param(scull_image, charp, S_IRUGO);
+module_param(scull_image_workers, uint, S_IRUGO);
+
 unsigned scull_nr_devs = 1;
 
+// Max quanta compressed in one pass of the compress worker, so it doesn't
+// hold dev->sem for too long.
+#define SCULL_COMPRESS_BATCH  256
+
+// Max quanta and qsets scanned in one pass of the compactor. A sweep of a big
+// device takes several passes, each resuming where the last one stopped.
+#define SCULL_COMPACT_BATCH   1024
+
+// Max quanta and qsets allocated for a write before taking dev->sem. The rest
+// of a bigger write is allocated with dev->sem held.
+#define SCULL_WRITE_POOL_QUANTA 256
+#define SCULL_WRITE_POOL_QSETS  4
+
+// Bucket i counts lock hold times in [2^(i-1), 2^i) ns.
+#define SCULL_HIST_BUCKETS  32
+
+// Qsets shown by one read of /proc/scull_device before dev->sem is released.
+#define SCULL_SEQ_CHUNK 64
+
+// Max quanta of one SCULL_IOC_CHECKSUM, so it doesn't hold dev->sem for too
+// long.
+#define SCULL_CSUM_MAX_QUANTA 4096
+
+// Bytes of the image read or written by one I/O.
+#define SCULL_IMAGE_CHUNK   (4 << 20)
+
+#define SCULL_KV_MAX_KEY    256
+#define SCULL_KV_MAX_BATCH  64
+#define SCULL_KV_MIN_SLOTS  64
+// Key of a deleted slot, probing continues past it.
+#define SCULL_KV_TOMBSTONE  ((char*)1)
+
+// Appenders waiting for their turn to publish are hashed by log offset.
+#define SCULL_LOG_WAIT_BITS 6
+
+// Appender waiting for log_commit to reach off. A killed appender leaves its
+// waiter abandoned, the appender before it publishes [off, end) then.
+struct scull_log_waiter {
+  struct hlist_node node;
+  struct task_struct* task;
+  uint64_t off;
+  uint64_t end;
+  bool ready;
+  bool abandoned;
+};
+
+// Header of a record in the atomic producer buffer, followed by len bytes of
+// data padded to 8 bytes. PAD records fill the end of the buffer.
+struct scull_krecord {
+  u32 len;
+  u32 flags;
+};
+
+#define SCULL_KRECORD_COMMITTED 1
+#define SCULL_KRECORD_PAD       2
+
+// Slot of the key-value index. The value is stored in the device log at
+// offsets [off, off + len), and is gone once the device is trimmed past it.
+struct scull_kv_slot {
+  char* key;
+  u32 hash;
+  u32 key_len;
+  uint64_t off;
+  uint64_t len;
+};
+
+struct scull_quantum_info {
+  struct list_head lru;
+  struct scull_qset* qset;
+  uint64_t pos;
+  unsigned long atime;
+  // When zdata != NULL, the quantum is compressed and qset->data[i] is NULL.
+  void* zdata;
+  // Size of zdata, or size of the quantum in the spill file when spilled.
+  unsigned zsize;
+  // Spilled quanta are stored at pos in the spill file, and are not in lru.
+  bool spilled;
+  // crc32c of the uncompressed quantum, with seed 0 and no final xor. It is
+  // updated with atomic xors, as appenders write to a quantum in parallel.
+  atomic_t crc;
+};
 
 struct scull_dev {
   struct semaphore sem;
+  // Protects qset, quantum, size and the log state for readers not holding
+  // dev->sem. Writers hold dev->sem.
+  seqcount_t seq;
+  // Woken when the size grows.
+  wait_queue_head_t size_wq;
   unsigned qset;
   unsigned quantum;
   uint64_t size;
   struct scull_qset* data;
+  // Allocated uncompressed quanta, least recently used first.
+  struct list_head lru;
+  // Compressed quanta, in the order they were compressed. They are off lru
+  // so the compressor doesn't scan them again, and go back to it when they
+  // are decompressed.
+  struct list_head zlru;
+  struct crypto_comp* tfm;
+  struct delayed_work compress_work;
+  unsigned long nr_hits;
+  unsigned long nr_misses;
+  unsigned long nr_compressed;
+  uint64_t compressed_bytes;
+  // Bytes of quanta in memory, raw or compressed.
+  uint64_t mem_bytes;
+  uint64_t mem_peak;
+  unsigned long mem_limit;
+  bool mem_block;
+  wait_queue_head_t mem_wq;
+  unsigned long nr_resident;
+  unsigned long nr_spilled;
+  // Bytes of qsets and their data/info arrays.
+  uint64_t meta_bytes;
+  struct delayed_work compact_work;
+  // Where the compactor stopped in its sweep, valid while compact_gen matches
+  // layout_gen. compact_last is the last qset seen holding anything.
+  struct scull_qset* compact_qset;
+  struct scull_qset* compact_last;
+  unsigned compact_i;
+  unsigned long compact_gen;
+  unsigned long write_hold_hist[SCULL_HIST_BUCKETS];
+  // Last qset looked up by scull_get_qset(), and its index in the list.
+  struct scull_qset* cursor_qset;
+  uint64_t cursor_item;
+  // Bumped whenever qsets are unlinked from the list.
+  unsigned long layout_gen;
+  // O_APPEND writers reserve log offsets [off, off + count) by bumping
+  // log_reserved without dev->sem, copy into their reserved quanta in
+  // parallel, and publish them in reservation order by moving log_commit.
+  // Device position 0 is at log offset log_base.
+  bool log_active;
+  uint64_t log_base;
+  atomic64_t log_reserved;
+  atomic64_t log_commit;
+  // Last quantum allocated for appends, which starts at log offset
+  // log_tail_off. Appends that fit in it pin it without dev->sem.
+  void* log_tail_q;
+  struct scull_quantum_info* log_tail_info;
+  uint64_t log_tail_off;
+  // Appenders copying into quanta, trims wait for them on log_wq.
+  atomic_t log_pinned;
+  wait_queue_head_t log_wq;
+  // Appenders waiting for log_commit to reach their offset, only the one it
+  // reaches is woken.
+  spinlock_t log_lock;
+  DECLARE_HASHTABLE(log_waiters, SCULL_LOG_WAIT_BITS);
+  // Open addressing index of the key-value objects, with linear probing.
+  // nr_used counts live and deleted slots. kv_lock is never held together
+  // with dev->sem.
+  struct mutex kv_lock;
+  struct scull_kv_slot* kv_slots;
+  unsigned kv_nr_slots;
+  unsigned kv_nr_used;
+  unsigned kv_nr_live;
+  // Ring of records reserved by kernel producers that can't sleep, appended
+  // to the log by kbuf_work in reservation order. Allocated by
+  // scull_prealloc_atomic().
+  spinlock_t kbuf_lock;
+  char* kbuf;
+  size_t kbuf_size;
+  uint64_t kbuf_head;
+  uint64_t kbuf_tail;
+  struct work_struct kbuf_work;
+  struct file* spill_filp;
+  struct shrinker shrinker;
+  // Serializes snapshots, taken before dev->sem.
+  struct mutex snapshot_lock;
   struct cdev cdev;
   struct proc_dir_entry* proc_entry;
+  struct proc_dir_entry* summary_entry;
 };
 
 struct scull_dev scull_dev;
@@ -68,6 +377,7 @@ static ssize_t scull_read(struct file* filp, char __user* buf, size_t count, lof
 static ssize_t scull_write(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos);
 static loff_t scull_llseek(struct file* filp, loff_t offset, int whence);
 static long scull_ioctl(struct file* filp, unsigned int cmd, unsigned long arg);
+static unsigned int scull_poll(struct file* filp, struct poll_table_struct* poll_table);
 
 static struct file_operations scull_ops = {
   .owner = THIS_MODULE,
@@ -77,16 +387,26 @@ static struct file_operations scull_ops = {
   .write = scull_write,
   .llseek = scull_llseek,
   .unlocked_ioctl = scull_ioctl,
+  .poll = scull_poll,
 };
 
 static int scull_proc_open(struct inode* inode, struct file* filp);
+static int scull_summary_open(struct inode* inode, struct file* filp);
 
 static struct file_operations scull_proc_ops = {
   .owner = THIS_MODULE,
   .open = scull_proc_open,
   .read = seq_read,
   .llseek = seq_lseek,
-  .release = seq_release,
+  .release = seq_release_private,
+};
+
+static struct file_operations scull_summary_ops = {
+  .owner = THIS_MODULE,
+  .open = scull_summary_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
 };
 
 static int scull_setup_cdev(struct scull_dev* dev, dev_t devno) {
@@ -109,14 +429,108 @@ static void scull_teardown_cdev(struct scull_dev* dev) {
 
 static int scull_setup_proc_file(struct scull_dev* dev) {
   dev->proc_entry = proc_create("scull_device", S_IRUGO, NULL, &scull_proc_ops);
-  return dev->proc_entry != NULL ? 0 : 1;
+  if (dev->proc_entry == NULL) {
+    return 1;
+  }
+  dev->summary_entry = proc_create("scull_device_summary", S_IRUGO, NULL, &scull_summary_ops);
+  if (dev->summary_entry == NULL) {
+    proc_remove(dev->proc_entry);
+    return 1;
+  }
+  return 0;
 }
 
 static void scull_teardown_proc_file(struct scull_dev* dev) {
+  proc_remove(dev->summary_entry);
   proc_remove(dev->proc_entry);
 }
 
+static void scull_compress_fn(struct work_struct* work);
+
+static unsigned long scull_compress_interval(void) {
+  unsigned long interval = scull_cold_secs * HZ / 2;
+  return interval != 0 ? interval : 1;
+}
+
+static int scull_setup_compress(struct scull_dev* dev) {
+  dev->tfm = NULL;
+  if (!scull_compress) {
+    return 0;
+  }
+  dev->tfm = crypto_alloc_comp(scull_compress_alg, 0, 0);
+  if (IS_ERR(dev->tfm)) {
+    pr_alert("crypto_alloc_comp(%s) failed: %ld\n", scull_compress_alg, PTR_ERR(dev->tfm));
+    dev->tfm = NULL;
+    return 1;
+  }
+  INIT_DELAYED_WORK(&dev->compress_work, scull_compress_fn);
+  schedule_delayed_work(&dev->compress_work, scull_compress_interval());
+  return 0;
+}
+
+static void scull_teardown_compress(struct scull_dev* dev) {
+  if (dev->tfm != NULL) {
+    cancel_delayed_work_sync(&dev->compress_work);
+    crypto_free_comp(dev->tfm);
+    dev->tfm = NULL;
+  }
+}
+
+static void scull_compact_fn(struct work_struct* work);
+
+static void scull_setup_compact(struct scull_dev* dev) {
+  INIT_DELAYED_WORK(&dev->compact_work, scull_compact_fn);
+  if (scull_compact_secs != 0) {
+    schedule_delayed_work(&dev->compact_work, scull_compact_secs * HZ);
+  }
+}
+
+static void scull_teardown_compact(struct scull_dev* dev) {
+  cancel_delayed_work_sync(&dev->compact_work);
+}
+
+static unsigned long scull_shrink_count(struct shrinker* shrinker, struct shrink_control* sc);
+static unsigned long scull_shrink_scan(struct shrinker* shrinker, struct shrink_control* sc);
+
+static int scull_setup_spill(struct scull_dev* dev) {
+  dev->spill_filp = NULL;
+  if (scull_spill_file == NULL) {
+    return 0;
+  }
+  dev->spill_filp = filp_open(scull_spill_file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+  if (IS_ERR(dev->spill_filp)) {
+    pr_alert("open spill file %s failed: %ld\n", scull_spill_file, PTR_ERR(dev->spill_filp));
+    dev->spill_filp = NULL;
+    return 1;
+  }
+  dev->shrinker.count_objects = scull_shrink_count;
+  dev->shrinker.scan_objects = scull_shrink_scan;
+  dev->shrinker.seeks = DEFAULT_SEEKS;
+  dev->shrinker.batch = 0;
+  dev->shrinker.flags = 0;
+  if (register_shrinker(&dev->shrinker) != 0) {
+    filp_close(dev->spill_filp, NULL);
+    dev->spill_filp = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+static void scull_teardown_spill(struct scull_dev* dev) {
+  if (dev->spill_filp != NULL) {
+    unregister_shrinker(&dev->shrinker);
+    filp_close(dev->spill_filp, NULL);
+    dev->spill_filp = NULL;
+  }
+}
+
+static void scull_kbuf_fn(struct work_struct* work);
+static int scull_load_image(struct scull_dev* dev);
+static int scull_trim(struct scull_dev* dev);
+
 static int hello_init(void) {
+  int err;
+
   pr_alert("Hello, World!\n");
   pr_alert("In process \"%s\" (pid %d, tgid %d)\n", current->comm, current->pid, current->tgid);
 
@@ -134,10 +548,67 @@ static int hello_init(void) {
   pr_alert("register/alloc chrdev_region major %d, minor 0-%d\n", scull_major, scull_nr_devs - 1);
 
   sema_init(&scull_dev.sem, 1);
+  seqcount_init(&scull_dev.seq);
+  init_waitqueue_head(&scull_dev.size_wq);
   scull_dev.quantum = scull_quantum;
   scull_dev.qset = scull_qset;
   scull_dev.size = 0;
   scull_dev.data = NULL;
+  INIT_LIST_HEAD(&scull_dev.lru);
+  INIT_LIST_HEAD(&scull_dev.zlru);
+  scull_dev.nr_hits = 0;
+  scull_dev.nr_misses = 0;
+  scull_dev.nr_compressed = 0;
+  scull_dev.compressed_bytes = 0;
+  scull_dev.mem_bytes = 0;
+  scull_dev.mem_peak = 0;
+  scull_dev.mem_limit = scull_mem_limit;
+  scull_dev.mem_block = scull_mem_block;
+  init_waitqueue_head(&scull_dev.mem_wq);
+  scull_dev.nr_resident = 0;
+  scull_dev.nr_spilled = 0;
+  scull_dev.meta_bytes = 0;
+  memset(scull_dev.write_hold_hist, 0, sizeof(scull_dev.write_hold_hist));
+  scull_dev.cursor_qset = NULL;
+  scull_dev.layout_gen = 0;
+  scull_dev.compact_qset = NULL;
+  scull_dev.compact_last = NULL;
+  scull_dev.compact_i = 0;
+  scull_dev.compact_gen = 0;
+  scull_dev.log_active = false;
+  scull_dev.log_base = 0;
+  atomic64_set(&scull_dev.log_reserved, 0);
+  atomic64_set(&scull_dev.log_commit, 0);
+  scull_dev.log_tail_q = NULL;
+  scull_dev.log_tail_info = NULL;
+  scull_dev.log_tail_off = 0;
+  atomic_set(&scull_dev.log_pinned, 0);
+  init_waitqueue_head(&scull_dev.log_wq);
+  spin_lock_init(&scull_dev.log_lock);
+  hash_init(scull_dev.log_waiters);
+  mutex_init(&scull_dev.kv_lock);
+  mutex_init(&scull_dev.snapshot_lock);
+  scull_dev.kv_slots = NULL;
+  scull_dev.kv_nr_slots = 0;
+  scull_dev.kv_nr_used = 0;
+  scull_dev.kv_nr_live = 0;
+  spin_lock_init(&scull_dev.kbuf_lock);
+  scull_dev.kbuf = NULL;
+  scull_dev.kbuf_size = 0;
+  scull_dev.kbuf_head = 0;
+  scull_dev.kbuf_tail = 0;
+  INIT_WORK(&scull_dev.kbuf_work, scull_kbuf_fn);
+  if (scull_setup_compress(&scull_dev) != 0) {
+    goto error_scull_setup_compress;
+  }
+  if (scull_setup_spill(&scull_dev) != 0) {
+    goto error_scull_setup_spill;
+  }
+  scull_setup_compact(&scull_dev);
+  err = scull_load_image(&scull_dev);
+  if (err != 0) {
+    pr_alert("load image %s failed: %d, starting empty\n", scull_image, err);
+  }
   if (scull_setup_cdev(&scull_dev, MKDEV(scull_major, 0)) != 0) {
     goto error_scull_setup_cdev;
   }
@@ -150,33 +621,95 @@ static int hello_init(void) {
 error_scull_setup_proc_file:
   scull_teardown_cdev(&scull_dev);
 error_scull_setup_cdev:
+  scull_teardown_compact(&scull_dev);
+  scull_trim(&scull_dev);
+  scull_teardown_spill(&scull_dev);
+error_scull_setup_spill:
+  scull_teardown_compress(&scull_dev);
+error_scull_setup_compress:
   unregister_chrdev_region(MKDEV(scull_major, 0), scull_nr_devs);
 error_register_dev_t:
   return 1;
 }
 
-static int scull_trim(struct scull_dev* dev) {
-  unsigned qset;
-  struct scull_qset* dptr, *next;
-  if (down_interruptible(&dev->sem)) {
-    return -ERESTARTSYS;
-  }
-  qset = dev->qset;
-  for (dptr = dev->data; dptr != NULL; dptr = next) {
-    unsigned i;
+static void scull_kv_free(struct scull_dev* dev);
+
+// Called with dev->sem held, around changes of the fields protected by dev->seq.
+static void scull_write_seqcount_begin(struct scull_dev* dev) {
+  preempt_disable();
+  write_seqcount_begin(&dev->seq);
+}
+
+static void scull_write_seqcount_end(struct scull_dev* dev) {
+  write_seqcount_end(&dev->seq);
+  preempt_enable();
+}
+
+// Free the qsets of the list starting at dptr, and their quanta.
+static void scull_free_qsets(struct scull_qset* dptr, unsigned qset) {
+  struct scull_qset* next;
+  unsigned i;
+
+  for (; dptr != NULL; dptr = next) {
     if (dptr->data) {
       for (i = 0; i < qset; ++i) {
         kfree(dptr->data[i]);
+        kfree(dptr->info[i].zdata);
       }
-      kfree(dptr->data);
+      kvfree(dptr->data);
+      kvfree(dptr->info);
     }
     next = dptr->next;
     kfree(dptr);
   }
+}
+
+static int scull_trim(struct scull_dev* dev) {
+  if (down_interruptible(&dev->sem)) {
+    return -ERESTARTSYS;
+  }
+  // Wait for appenders still copying into quanta. Appenders pin the tail
+  // quantum before checking dev->seq, so once the tail is cleared, either
+  // they see it or the trim sees them.
+  for (;;) {
+    scull_write_seqcount_begin(dev);
+    dev->log_tail_q = NULL;
+    scull_write_seqcount_end(dev);
+    smp_mb();
+    if (atomic_read(&dev->log_pinned) == 0) {
+      break;
+    }
+    up(&dev->sem);
+    if (wait_event_interruptible(dev->log_wq, atomic_read(&dev->log_pinned) == 0)) {
+      return -ERESTARTSYS;
+    }
+    if (down_interruptible(&dev->sem)) {
+      return -ERESTARTSYS;
+    }
+  }
+  scull_free_qsets(dev->data, dev->qset);
+  INIT_LIST_HEAD(&dev->lru);
+  INIT_LIST_HEAD(&dev->zlru);
+  dev->meta_bytes = 0;
+  dev->nr_compressed = 0;
+  dev->compressed_bytes = 0;
+  dev->mem_bytes = 0;
+  wake_up_interruptible(&dev->mem_wq);
+  dev->nr_resident = 0;
+  if (dev->nr_spilled != 0) {
+    vfs_truncate(&dev->spill_filp->f_path, 0);
+    dev->nr_spilled = 0;
+  }
+  scull_write_seqcount_begin(dev);
   dev->size = 0;
   dev->quantum = scull_quantum;
   dev->qset = scull_qset;
+  // Appends reserved before the trim are dropped.
+  dev->log_base = atomic64_read(&dev->log_reserved);
+  scull_write_seqcount_end(dev);
   dev->data = NULL;
+  dev->cursor_qset = NULL;
+  dev->layout_gen++;
 
   up(&dev->sem);
   return 0;
@@ -185,17 +718,46 @@ static int scull_trim(struct scull_dev* dev) {
 static void hello_exit(void) {
   pr_alert("Goodbye, cruel world\n");
   pr_alert("In process \"%s\" (pid %d, tgid %d)\n", current->comm, current->pid, current->tgid);
+  scull_teardown_compact(&scull_dev);
+  scull_teardown_compress(&scull_dev);
+  flush_work(&scull_dev.kbuf_work);
+  kvfree(scull_dev.kbuf);
   scull_trim(&scull_dev);
+  scull_kv_free(&scull_dev);
+  scull_teardown_spill(&scull_dev);
   scull_teardown_proc_file(&scull_dev);
   scull_teardown_cdev(&scull_dev);
   unregister_chrdev_region(MKDEV(scull_major, 0), scull_nr_devs);
 }
 
+// Called with dev->sem held.
+static void scull_activate_log(struct scull_dev* dev) {
+  if (dev->log_active) {
+    return;
+  }
+  // No appender can exist yet, so it is safe to start the log at the end of
+  // the device.
+  scull_write_seqcount_begin(dev);
+  dev->log_base = 0;
+  atomic64_set(&dev->log_reserved, dev->size);
+  atomic64_set(&dev->log_commit, dev->size);
+  dev->log_active = true;
+  scull_write_seqcount_end(dev);
+}
+
 static int scull_open(struct inode* inode, struct file* filp) {
   struct scull_dev* dev;
   pr_alert("scull_open\n");
   dev = container_of(inode->i_cdev, struct scull_dev, cdev);
   filp->private_data = dev;
+  if (filp->f_flags & O_APPEND) {
+    if (down_interruptible(&dev->sem)) {
+      return -ERESTARTSYS;
+    }
+    scull_activate_log(dev);
+    up(&dev->sem);
+    return 0;
+  }
   if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
     return scull_trim(dev);
   }
@@ -207,184 +769,1862 @@ static int scull_release(struct inode* inode, struct file* filp) {
   return 0;
 }
 
-static ssize_t scull_read(struct file* filp, char __user* buf, size_t count, loff_t* f_pos) {
-  struct scull_dev* dev = filp->private_data;
-  struct scull_qset* dptr;
-  unsigned quantum;
-  unsigned qset;
-  uint64_t itemsize;
-  uint64_t last_pos = *f_pos;
-  size_t last_count;
-  int retval = 0;
-  pr_alert("scull_read, size = %llu\n", dev->size);
-
-  if (down_interruptible(&dev->sem)) {
-    return -ERESTARTSYS;
+static void scull_add_mem(struct scull_dev* dev, uint64_t bytes) {
+  dev->mem_bytes += bytes;
+  if (dev->mem_bytes > dev->mem_peak) {
+    dev->mem_peak = dev->mem_bytes;
   }
-  quantum = dev->quantum;
-  qset = dev->qset;
-  itemsize = (uint64_t)quantum * qset;
+}
 
-  for (dptr = dev->data; dptr != NULL; dptr = dptr->next) {
-    if (last_pos < itemsize) {
-      break;
-    }
-    last_pos -= itemsize;
-  }
+// Fold the change of q[offset, offset + len) into the checksum of q. old is
+// the crc32c of the range before the change. With seed 0 and no final xor,
+// crc32c is linear, so the xor of the old and new range, shifted past the
+// rest of the quantum, is the change of the whole checksum.
+static void scull_update_crc(struct scull_quantum_info* info, unsigned quantum, void* q,
+                             unsigned offset, unsigned len, u32 old) {
+  u32 delta = old ^ crc32c(0, (char*)q + offset, len);
+  atomic_xor(__crc32c_le_shift(delta, quantum - offset - len), &info->crc);
+}
 
-  if (count > dev->size - *f_pos) {
-    count = dev->size - *f_pos;
-  }
-  last_count = count;
-  pr_alert("last_count = %zu\n", last_count);
-  while (last_count != 0) {
-    void** data;
-    unsigned quantum_id;
-    char* p;
-    unsigned copy_count;
+static void scull_touch_quantum(struct scull_dev* dev, struct scull_quantum_info* info) {
+  info->atime = jiffies;
+  list_move_tail(&info->lru, &dev->lru);
+}
 
-    if (dptr == NULL) {
-      break;
-    }
-    data = dptr->data;
-    quantum_id = last_pos / quantum;
-    if (data == NULL || data[quantum_id] == NULL) {
-      break;
-    }
-    p = (char*)data[quantum_id] + last_pos % quantum;
-    copy_count = quantum - last_pos % quantum;
-    if (copy_count > last_count) {
-      copy_count = last_count;
-    }
-    if (copy_to_user(buf, p, copy_count) != 0) {
-      retval = -EFAULT;
-      goto out;
-    }
-    last_count -= copy_count;
-    last_pos += copy_count;
-    buf += copy_count;
-    if (last_count != 0 && last_pos >= itemsize) {
-      dptr = dptr->next;
-      last_pos -= itemsize;
-    }
+static void scull_add_quantum(struct scull_dev* dev, struct scull_qset* dptr, unsigned i, void* q,
+                              uint64_t pos) {
+  struct scull_quantum_info* info = &dptr->info[i];
+  dptr->data[i] = q;
+  info->qset = dptr;
+  info->pos = pos;
+  info->atime = jiffies;
+  atomic_set(&info->crc, 0);
+  list_add_tail(&info->lru, &dev->lru);
+  scull_add_mem(dev, dev->quantum);
+  dev->nr_resident++;
+}
+
+// Decompress zsize bytes of zdata into buf, of dev->quantum bytes.
+static int scull_decompress(struct scull_dev* dev, const void* zdata, unsigned zsize, void* buf) {
+  unsigned dlen = dev->quantum;
+  int err;
+
+  err = crypto_comp_decompress(dev->tfm, zdata, zsize, buf, &dlen);
+  if (err != 0 || dlen != dev->quantum) {
+    pr_alert("decompress quantum failed: %d, dlen = %u\n", err, dlen);
+    return -EIO;
   }
+  return 0;
+}
 
-  retval = count - last_count;
-  *f_pos += retval;
+static void* scull_decompress_quantum(struct scull_dev* dev, struct scull_qset* dptr, unsigned i) {
+  struct scull_quantum_info* info = &dptr->info[i];
+  void* q;
+  int err;
 
-  pr_alert("scull_read, count = %zu, ret_val = %d, *f_pos = %lld\n",
-           count, retval, *f_pos);
+  q = kmalloc(dev->quantum, GFP_KERNEL_ACCOUNT);
+  if (q == NULL) {
+    return ERR_PTR(-ENOMEM);
+  }
+  err = scull_decompress(dev, info->zdata, info->zsize, q);
+  if (err != 0) {
+    kfree(q);
+    return ERR_PTR(err);
+  }
+  dev->nr_compressed--;
+  dev->compressed_bytes -= info->zsize;
+  scull_add_mem(dev, dev->quantum - info->zsize);
+  kfree(info->zdata);
+  info->zdata = NULL;
+  info->zsize = 0;
+  dptr->data[i] = q;
+  return q;
+}
 
-out:
-  up(&dev->sem);
-  return retval;
+// Return the device size appenders have published. Called with dev->sem held.
+static uint64_t scull_log_committed(struct scull_dev* dev) {
+  uint64_t commit = atomic64_read_acquire(&dev->log_commit);
+  return commit > dev->log_base ? commit - dev->log_base : 0;
 }
 
-static loff_t scull_llseek(struct file* filp, loff_t offset, int whence) {
-  struct scull_dev* dev = filp->private_data;
+// Can be called without dev->sem.
+static uint64_t scull_dev_size(struct scull_dev* dev) {
   uint64_t size;
-  loff_t new_pos;
-  loff_t retval = 0;
+  uint64_t base;
+  uint64_t commit;
+  bool log_active;
+  unsigned seq;
 
-  if (down_interruptible(&dev->sem)) {
-    return -ERESTARTSYS;
+  do {
+    seq = read_seqcount_begin(&dev->seq);
+    size = dev->size;
+    base = dev->log_base;
+    log_active = dev->log_active;
+  } while (read_seqcount_retry(&dev->seq, seq));
+  if (log_active) {
+    commit = atomic64_read_acquire(&dev->log_commit);
+    if (commit > base && commit - base > size) {
+      size = commit - base;
+    }
   }
-  size = dev->size;
+  return size;
+}
 
-  if (whence == 0) {
-    new_pos = offset;
-  } else if (whence == 1) {
-    new_pos = size + offset;
-  } else if (whence == 2) {
-    new_pos = filp->f_pos + offset;
+// Quanta past the log commit may be being written by appenders without
+// dev->sem, so they can't be compressed, spilled or freed.
+static bool scull_quantum_busy(struct scull_dev* dev, struct scull_quantum_info* info) {
+  return dev->log_active && info->pos + dev->quantum > scull_log_committed(dev);
+}
+
+// Write quantum to the spill file, and free its memory.
+static int scull_spill_quantum(struct scull_dev* dev, struct scull_quantum_info* info) {
+  unsigned i = info - info->qset->info;
+  void* buf = info->qset->data[i];
+  unsigned len = dev->quantum;
+  loff_t pos = info->pos;
+  ssize_t written;
+
+  if (buf == NULL) {
+    buf = info->zdata;
+    len = info->zsize;
+  }
+  written = kernel_write(dev->spill_filp, buf, len, &pos);
+  if (written != len) {
+    pr_alert("spill quantum at %llu failed: %zd\n", info->pos, written);
+    return written < 0 ? written : -EIO;
+  }
+  if (info->zdata != NULL) {
+    dev->nr_compressed--;
+    dev->compressed_bytes -= info->zsize;
+    info->zdata = NULL;
   } else {
-    retval = -EINVAL;
-    goto out;
+    info->qset->data[i] = NULL;
   }
+  kfree(buf);
+  info->zsize = len;
+  info->spilled = true;
+  list_del(&info->lru);
+  dev->mem_bytes -= len;
+  dev->nr_resident--;
+  dev->nr_spilled++;
+  return 0;
+}
 
-  if (new_pos < 0 || new_pos > size) {
-    retval = -EINVAL;
-    goto out;
+// Read the zsize bytes of a spilled quantum into buf.
+static int scull_read_spilled(struct scull_dev* dev, struct scull_quantum_info* info, void* buf) {
+  loff_t pos = info->pos;
+  ssize_t nread;
+
+  nread = kernel_read(dev->spill_filp, buf, info->zsize, &pos);
+  if (nread != info->zsize) {
+    pr_alert("read spilled quantum at %llu failed: %zd\n", info->pos, nread);
+    return nread < 0 ? nread : -EIO;
   }
-  filp->f_pos = new_pos;
-  retval = new_pos;
-out:
-  up(&dev->sem);
-  return retval;
+  return 0;
 }
-static ssize_t scull_write(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos) {
-  struct scull_dev* dev = filp->private_data;
-  struct scull_qset* dptr, *prev_qset;
-  unsigned quantum;
-  unsigned qset;
-  uint64_t itemsize;
-  uint64_t last_pos = *f_pos;
-  size_t last_count;
-  int retval = 0;
 
-  if (down_interruptible(&dev->sem)) {
-    return -ERESTARTSYS;
+static int scull_unspill_quantum(struct scull_dev* dev, struct scull_qset* dptr, unsigned i) {
+  struct scull_quantum_info* info = &dptr->info[i];
+  void* buf;
+  int err;
+
+  buf = kmalloc(info->zsize, GFP_KERNEL_ACCOUNT);
+  if (buf == NULL) {
+    return -ENOMEM;
   }
-  quantum = dev->quantum;
-  qset = dev->qset;
-  itemsize = (uint64_t)quantum * qset;
+  err = scull_read_spilled(dev, info, buf);
+  if (err != 0) {
+    kfree(buf);
+    return err;
+  }
+  if (info->zsize == dev->quantum) {
+    dptr->data[i] = buf;
+  } else {
+    info->zdata = buf;
+    dev->nr_compressed++;
+    dev->compressed_bytes += info->zsize;
+  }
+  info->spilled = false;
+  list_add_tail(&info->lru, info->zdata != NULL ? &dev->zlru : &dev->lru);
+  scull_add_mem(dev, info->zsize);
+  dev->nr_resident++;
+  dev->nr_spilled--;
+  return 0;
+}
 
-  pr_alert("scull_write\n");
+// Spill at most nr least recently used quanta, return the number spilled.
+// Compressed quanta went cold before any quantum still on dev->lru, so they
+// go first.
+static unsigned long scull_spill_lru(struct scull_dev* dev, unsigned long nr) {
+  struct list_head* lists[] = { &dev->zlru, &dev->lru };
+  struct scull_quantum_info* info, *tmp;
+  unsigned long spilled = 0;
+  unsigned i;
 
-  prev_qset = NULL;
-  for (dptr = dev->data; dptr != NULL; dptr = dptr->next) {
-    if (last_pos < itemsize) {
-      break;
+  for (i = 0; i < ARRAY_SIZE(lists); ++i) {
+    list_for_each_entry_safe(info, tmp, lists[i], lru) {
+      if (scull_quantum_busy(dev, info)) {
+        continue;
+      }
+      if (spilled == nr || scull_spill_quantum(dev, info) != 0) {
+        return spilled;
+      }
+      spilled++;
     }
-    last_pos -= itemsize;
-    prev_qset = dptr;
   }
+  return spilled;
+}
 
-  last_count = count;
-  while (last_count != 0) {
-    void** data;
-    unsigned quantum_id;
-    char* p;
-    unsigned copy_count;
-    if (dptr == NULL) {
-      dptr = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-      if (dptr == NULL) {
-        retval = -ENOMEM;
-        goto out;
+static void scull_enforce_mem_budget(struct scull_dev* dev) {
+  struct list_head* lists[] = { &dev->zlru, &dev->lru };
+  struct scull_quantum_info* info, *tmp;
+  unsigned i;
+
+  if (dev->spill_filp == NULL || scull_mem_budget == 0) {
+    return;
+  }
+  for (i = 0; i < ARRAY_SIZE(lists); ++i) {
+    list_for_each_entry_safe(info, tmp, lists[i], lru) {
+      if (scull_quantum_busy(dev, info)) {
+        continue;
       }
-      dptr->next = NULL;
-      dptr->data = NULL;
-      if (prev_qset != NULL) {
-        prev_qset->next = dptr;
-      } else {
-        dev->data = dptr;
+      if (dev->mem_bytes <= scull_mem_budget || scull_spill_quantum(dev, info) != 0) {
+        return;
       }
     }
-    data = dptr->data;
-    if (data == NULL) {
-      data = kmalloc(qset * sizeof(void*), GFP_KERNEL);
-      if (data == NULL) {
-        retval = -ENOMEM;
-        goto out;
+  }
+}
+
+static unsigned long scull_shrink_count(struct shrinker* shrinker, struct shrink_control* sc) {
+  struct scull_dev* dev = container_of(shrinker, struct scull_dev, shrinker);
+  return READ_ONCE(dev->nr_resident);
+}
+
+static unsigned long scull_shrink_scan(struct shrinker* shrinker, struct shrink_control* sc) {
+  struct scull_dev* dev = container_of(shrinker, struct scull_dev, shrinker);
+  unsigned long freed;
+
+  // Writing the spill file may need fs locks held by the reclaimer.
+  if (!(sc->gfp_mask & __GFP_FS) || down_trylock(&dev->sem)) {
+    return SHRINK_STOP;
+  }
+  freed = scull_spill_lru(dev, sc->nr_to_scan);
+  up(&dev->sem);
+  if (freed != 0) {
+    wake_up_interruptible(&dev->mem_wq);
+  }
+  return freed != 0 ? freed : SHRINK_STOP;
+}
+
+static bool scull_has_mem_room(struct scull_dev* dev) {
+  unsigned long limit = READ_ONCE(dev->mem_limit);
+  return limit == 0 || dev->mem_bytes + dev->quantum <= limit;
+}
+
+// Make room for a new quantum under dev->mem_limit. Return 0 if there is
+// room, 1 if the writer should wait for room without holding dev->sem, or
+// a negative error.
+static int scull_reserve_mem(struct scull_dev* dev, struct file* filp) {
+  while (!scull_has_mem_room(dev)) {
+    if (dev->spill_filp != NULL && scull_spill_lru(dev, 1) == 1) {
+      continue;
+    }
+    if (!dev->mem_block) {
+      return -ENOSPC;
+    }
+    if (filp != NULL && (filp->f_flags & O_NONBLOCK)) {
+      return -EAGAIN;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// Return the uncompressed quantum i of dptr, NULL if it isn't allocated.
+static void* scull_get_quantum(struct scull_dev* dev, struct scull_qset* dptr, unsigned i) {
+  struct scull_quantum_info* info = &dptr->info[i];
+  void* q = dptr->data[i];
+  int err;
+
+  if (q != NULL) {
+    dev->nr_hits++;
+    scull_touch_quantum(dev, info);
+    return q;
+  }
+  if (info->zdata == NULL && !info->spilled) {
+    return NULL;
+  }
+  dev->nr_misses++;
+  if (info->spilled) {
+    err = scull_unspill_quantum(dev, dptr, i);
+    if (err != 0) {
+      return ERR_PTR(err);
+    }
+    q = dptr->data[i];
+  }
+  if (q == NULL) {
+    q = scull_decompress_quantum(dev, dptr, i);
+    if (IS_ERR(q)) {
+      return q;
+    }
+  }
+  scull_touch_quantum(dev, info);
+  return q;
+}
+
+// Like scull_get_quantum(), but a compressed or spilled quantum is read into
+// buf, of dev->quantum bytes, and stays as it is. zbuf, of dev->quantum bytes
+// too, holds a compressed quantum read back from the spill file.
+static void* scull_peek_quantum(struct scull_dev* dev, struct scull_qset* dptr, unsigned i,
+                                void* buf, void* zbuf) {
+  struct scull_quantum_info* info = &dptr->info[i];
+  const void* zdata = info->zdata;
+  int err;
+
+  if (dptr->data[i] != NULL) {
+    return dptr->data[i];
+  }
+  if (zdata == NULL && !info->spilled) {
+    return NULL;
+  }
+  if (info->spilled) {
+    err = scull_read_spilled(dev, info, info->zsize == dev->quantum ? buf : zbuf);
+    if (err != 0) {
+      return ERR_PTR(err);
+    }
+    if (info->zsize == dev->quantum) {
+      return buf;
+    }
+    zdata = zbuf;
+  }
+  err = scull_decompress(dev, zdata, info->zsize, buf);
+  return err != 0 ? ERR_PTR(err) : buf;
+}
+
+// Use buf (of dev->quantum bytes) as the output buffer. Return 0 if the
+// quantum is compressed, or it isn't worth compressing.
+static int scull_compress_quantum(struct scull_dev* dev, struct scull_quantum_info* info, void* buf) {
+  unsigned i = info - info->qset->info;
+  void* q = info->qset->data[i];
+  unsigned zlen = dev->quantum;
+  void* zdata;
+
+  if (crypto_comp_compress(dev->tfm, q, dev->quantum, buf, &zlen) != 0 ||
+      zlen >= dev->quantum - dev->quantum / 8) {
+    // Incompressible, check it again after another cold period.
+    scull_touch_quantum(dev, info);
+    return 0;
+  }
+  zdata = kmalloc(zlen, GFP_KERNEL_ACCOUNT);
+  if (zdata == NULL) {
+    return -ENOMEM;
+  }
+  memcpy(zdata, buf, zlen);
+  info->zdata = zdata;
+  info->zsize = zlen;
+  info->qset->data[i] = NULL;
+  kfree(q);
+  list_move_tail(&info->lru, &dev->zlru);
+  dev->nr_compressed++;
+  dev->compressed_bytes += zlen;
+  dev->mem_bytes -= dev->quantum - zlen;
+  return 0;
+}
+
+static void scull_compress_fn(struct work_struct* work) {
+  struct scull_dev* dev = container_of(to_delayed_work(work), struct scull_dev, compress_work);
+  struct scull_quantum_info* info, *tmp;
+  unsigned long cold = scull_cold_secs * HZ;
+  unsigned nr = 0;
+  void* buf;
+
+  down(&dev->sem);
+  buf = kmalloc(dev->quantum, GFP_KERNEL);
+  if (buf != NULL) {
+    list_for_each_entry_safe(info, tmp, &dev->lru, lru) {
+      if (time_before(jiffies, info->atime + cold) || nr == SCULL_COMPRESS_BATCH) {
+        break;
+      }
+      if (scull_quantum_busy(dev, info)) {
+        continue;
+      }
+      if (scull_compress_quantum(dev, info, buf) != 0) {
+        break;
+      }
+      nr++;
+    }
+    kfree(buf);
+  }
+  up(&dev->sem);
+  if (nr != 0) {
+    wake_up_interruptible(&dev->mem_wq);
+  }
+  schedule_delayed_work(&dev->compress_work, nr == SCULL_COMPRESS_BATCH ? 1 : scull_compress_interval());
+}
+
+static uint64_t scull_qset_array_bytes(unsigned qset) {
+  return (uint64_t)qset * (sizeof(void*) + sizeof(struct scull_quantum_info));
+}
+
+// Drop a quantum holding only zeros, it reads back as a hole.
+static void scull_free_zero_quantum(struct scull_dev* dev, struct scull_qset* dptr, unsigned i) {
+  kfree(dptr->data[i]);
+  dptr->data[i] = NULL;
+  list_del(&dptr->info[i].lru);
+  dev->mem_bytes -= dev->quantum;
+  dev->nr_resident--;
+}
+
+static bool scull_qset_empty(struct scull_dev* dev, struct scull_qset* dptr) {
+  unsigned i;
+
+  for (i = 0; i < dev->qset; ++i) {
+    if (dptr->data[i] != NULL || dptr->info[i].zdata != NULL || dptr->info[i].spilled) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void scull_compact_fn(struct work_struct* work) {
+  struct scull_dev* dev = container_of(to_delayed_work(work), struct scull_dev, compact_work);
+  struct scull_qset* dptr, *last, *next;
+  unsigned long nr_freed = 0;
+  unsigned nr_scanned = 0;
+  unsigned i;
+  bool done;
+
+  down(&dev->sem);
+  if (dev->compact_qset == NULL || dev->compact_gen != dev->layout_gen) {
+    // Start a new sweep.
+    dev->compact_qset = dev->data;
+    dev->compact_last = NULL;
+    dev->compact_i = 0;
+    dev->compact_gen = dev->layout_gen;
+  }
+  dptr = dev->compact_qset;
+  i = dev->compact_i;
+  while (dptr != NULL && nr_scanned < SCULL_COMPACT_BATCH) {
+    nr_scanned++;
+    if (dptr->data != NULL) {
+      for (; i < dev->qset && nr_scanned < SCULL_COMPACT_BATCH; ++i) {
+        if (dptr->data[i] == NULL || scull_quantum_busy(dev, &dptr->info[i])) {
+          continue;
+        }
+        nr_scanned++;
+        if (memchr_inv(dptr->data[i], 0, dev->quantum) == NULL) {
+          scull_free_zero_quantum(dev, dptr, i);
+          nr_freed++;
+        }
+      }
+      if (i < dev->qset) {
+        // Resume in this qset next pass.
+        break;
+      }
+      if (scull_qset_empty(dev, dptr)) {
+        kvfree(dptr->data);
+        kvfree(dptr->info);
+        dptr->data = NULL;
+        dptr->info = NULL;
+        dev->meta_bytes -= scull_qset_array_bytes(dev->qset);
+      } else {
+        dev->compact_last = dptr;
+      }
+    }
+    dptr = dptr->next;
+    i = 0;
+  }
+  dev->compact_qset = dptr;
+  dev->compact_i = i;
+  done = dptr == NULL;
+  if (done) {
+    // Trailing qsets hold nothing, reads past the last one return zeros.
+    // Writers may have filled qsets behind the sweep, so check the tail again.
+    last = dev->compact_last;
+    for (dptr = last != NULL ? last->next : dev->data; dptr != NULL; dptr = dptr->next) {
+      if (dptr->data != NULL) {
+        last = dptr;
+      }
+    }
+    if (last != NULL) {
+      dptr = last->next;
+      last->next = NULL;
+    } else {
+      dptr = dev->data;
+      dev->data = NULL;
+    }
+    if (dptr != NULL) {
+      dev->cursor_qset = NULL;
+      dev->layout_gen++;
+    }
+    for (; dptr != NULL; dptr = next) {
+      next = dptr->next;
+      kfree(dptr);
+      dev->meta_bytes -= sizeof(struct scull_qset);
+    }
+  }
+  up(&dev->sem);
+  if (nr_freed != 0) {
+    wake_up_interruptible(&dev->mem_wq);
+  }
+  schedule_delayed_work(&dev->compact_work, done ? scull_compact_secs * HZ : 1);
+}
+
+// Copy device positions [pos, pos + count) to buf, up to the device size.
+// Return the number of bytes copied. Quanta read back from the spill file or
+// decompressed push colder ones out again, so a long read stays within the
+// memory budget. Called with dev->sem held.
+static ssize_t scull_copy_out(struct scull_dev* dev, char __user* buf, size_t count, uint64_t pos) {
+  struct scull_qset* dptr;
+  unsigned quantum;
+  unsigned qset;
+  uint64_t itemsize;
+  uint64_t size;
+  uint64_t last_pos = pos;
+  size_t last_count;
+
+  quantum = dev->quantum;
+  qset = dev->qset;
+  itemsize = (uint64_t)quantum * qset;
+
+  dptr = dev->data;
+  while (last_pos >= itemsize) {
+    if (dptr != NULL) {
+      dptr = dptr->next;
+    }
+    last_pos -= itemsize;
+  }
+
+  size = scull_dev_size(dev);
+  if (pos >= size) {
+    count = 0;
+  } else if (count > size - pos) {
+    count = size - pos;
+  }
+  last_count = count;
+  pr_alert("last_count = %zu\n", last_count);
+  while (last_count != 0) {
+    unsigned quantum_id;
+    void* q;
+    char* p;
+    unsigned copy_count;
+
+    q = NULL;
+    if (dptr != NULL && dptr->data != NULL) {
+      quantum_id = last_pos / quantum;
+      q = scull_get_quantum(dev, dptr, quantum_id);
+      if (IS_ERR(q)) {
+        return PTR_ERR(q);
+      }
+    }
+    copy_count = quantum - last_pos % quantum;
+    if (copy_count > last_count) {
+      copy_count = last_count;
+    }
+    if (q != NULL) {
+      p = (char*)q + last_pos % quantum;
+      if (copy_to_user(buf, p, copy_count) != 0) {
+        return -EFAULT;
+      }
+    } else if (clear_user(buf, copy_count) != 0) {
+      // Holes below dev->size read as zeros.
+      return -EFAULT;
+    }
+    scull_enforce_mem_budget(dev);
+    last_count -= copy_count;
+    last_pos += copy_count;
+    buf += copy_count;
+    if (last_count != 0 && last_pos >= itemsize) {
+      if (dptr != NULL) {
+        dptr = dptr->next;
+      }
+      last_pos -= itemsize;
+    }
+  }
+  return count - last_count;
+}
+
+static ssize_t scull_read(struct file* filp, char __user* buf, size_t count, loff_t* f_pos) {
+  struct scull_dev* dev = filp->private_data;
+  int retval = 0;
+  pr_alert("scull_read, size = %llu\n", dev->size);
+
+  if (down_interruptible(&dev->sem)) {
+    return -ERESTARTSYS;
+  }
+  retval = scull_copy_out(dev, buf, count, *f_pos);
+  if (retval > 0) {
+    *f_pos += retval;
+  }
+
+  pr_alert("scull_read, count = %zu, ret_val = %d, *f_pos = %lld\n",
+           count, retval, *f_pos);
+
+  up(&dev->sem);
+  return retval;
+}
+
+static loff_t scull_llseek(struct file* filp, loff_t offset, int whence) {
+  struct scull_dev* dev = filp->private_data;
+  uint64_t size;
+  loff_t new_pos;
+
+  // Don't wait for dev->sem to read the size, it can be held by a long read
+  // or write. The file position is still only changed under filp->f_lock.
+  size = scull_dev_size(dev);
+
+  spin_lock(&filp->f_lock);
+  if (whence == SEEK_SET) {
+    new_pos = offset;
+  } else if (whence == SEEK_CUR) {
+    new_pos = filp->f_pos + offset;
+  } else if (whence == SEEK_END) {
+    new_pos = size + offset;
+  } else {
+    new_pos = -EINVAL;
+    goto out;
+  }
+
+  if (new_pos < 0 || new_pos > size) {
+    new_pos = -EINVAL;
+    goto out;
+  }
+  filp->f_pos = new_pos;
+out:
+  spin_unlock(&filp->f_lock);
+  return new_pos;
+}
+// Quanta and qsets allocated before taking dev->sem, for the part of a write
+// past the end of the device.
+struct scull_write_pool {
+  unsigned quantum;
+  unsigned qset;
+  // Free zeroed quanta, linked through their first word.
+  void* quanta;
+  // Free qsets with their data and info arrays, linked through next.
+  struct scull_qset* qsets;
+};
+
+static struct scull_qset* scull_alloc_qset(unsigned qset) {
+  struct scull_qset* dptr = kmalloc(sizeof(struct scull_qset), GFP_KERNEL_ACCOUNT);
+  if (dptr == NULL) {
+    return NULL;
+  }
+  dptr->next = NULL;
+  // Use kvcalloc() so big qsets don't need high-order pages.
+  dptr->data = kvcalloc(qset, sizeof(void*), GFP_KERNEL_ACCOUNT);
+  dptr->info = kvcalloc(qset, sizeof(struct scull_quantum_info), GFP_KERNEL_ACCOUNT);
+  if (dptr->data == NULL || dptr->info == NULL) {
+    kvfree(dptr->data);
+    kvfree(dptr->info);
+    kfree(dptr);
+    return NULL;
+  }
+  return dptr;
+}
+
+static void scull_fill_write_pool(struct scull_dev* dev, struct scull_write_pool* pool,
+                                  uint64_t pos, size_t count) {
+  uint64_t size = READ_ONCE(dev->size);
+  uint64_t end = pos + count;
+  unsigned long limit = READ_ONCE(dev->mem_limit);
+  uint64_t mem_bytes = READ_ONCE(dev->mem_bytes);
+  uint64_t itemsize;
+  uint64_t start;
+  unsigned max_quanta = SCULL_WRITE_POOL_QUANTA;
+  unsigned nr;
+
+  pool->quantum = READ_ONCE(dev->quantum);
+  pool->qset = READ_ONCE(dev->qset);
+  pool->quanta = NULL;
+  pool->qsets = NULL;
+  if (!scull_write_prealloc) {
+    return;
+  }
+  itemsize = (uint64_t)pool->quantum * pool->qset;
+  // Don't allocate and charge quanta past dev->mem_limit, the write would
+  // free them after scull_reserve_mem() refuses it.
+  if (limit != 0) {
+    max_quanta = mem_bytes < limit ? min_t(uint64_t, max_quanta, (limit - mem_bytes) / pool->quantum)
+                                   : 0;
+  }
+  // Quanta below the device size are probably allocated.
+  start = max(pos, roundup(size, (uint64_t)pool->quantum));
+  for (nr = 0; start < end && nr < max_quanta; ++nr) {
+    void* q = kzalloc(pool->quantum, GFP_KERNEL_ACCOUNT);
+    if (q == NULL) {
+      return;
+    }
+    *(void**)q = pool->quanta;
+    pool->quanta = q;
+    start = (start / pool->quantum + 1) * pool->quantum;
+  }
+  start = max(pos, roundup(size, itemsize));
+  for (nr = 0; start < end && nr < SCULL_WRITE_POOL_QSETS; ++nr) {
+    struct scull_qset* dptr = scull_alloc_qset(pool->qset);
+    if (dptr == NULL) {
+      return;
+    }
+    dptr->next = pool->qsets;
+    pool->qsets = dptr;
+    start = (start / itemsize + 1) * itemsize;
+  }
+}
+
+static void scull_drain_write_pool(struct scull_write_pool* pool) {
+  while (pool->quanta != NULL) {
+    void* q = pool->quanta;
+    pool->quanta = *(void**)q;
+    kfree(q);
+  }
+  while (pool->qsets != NULL) {
+    struct scull_qset* dptr = pool->qsets;
+    pool->qsets = dptr->next;
+    kvfree(dptr->data);
+    kvfree(dptr->info);
+    kfree(dptr);
+  }
+}
+
+// Called with dev->sem held, fall back to allocating if the pool is empty.
+static void* scull_pool_get_quantum(struct scull_write_pool* pool) {
+  void* q = pool->quanta;
+  if (q == NULL) {
+    return kzalloc(pool->quantum, GFP_KERNEL_ACCOUNT);
+  }
+  pool->quanta = *(void**)q;
+  *(void**)q = NULL;
+  return q;
+}
+
+static struct scull_qset* scull_pool_get_qset(struct scull_write_pool* pool) {
+  struct scull_qset* dptr = pool->qsets;
+  if (dptr == NULL) {
+    return scull_alloc_qset(pool->qset);
+  }
+  pool->qsets = dptr->next;
+  dptr->next = NULL;
+  return dptr;
+}
+
+static void scull_write_lock_held(struct scull_dev* dev, u64 start_ns) {
+  u64 ns = ktime_get_ns() - start_ns;
+  dev->write_hold_hist[min_t(unsigned, fls64(ns), SCULL_HIST_BUCKETS - 1)]++;
+}
+
+// Return the qset at index item of the list, linking new qsets from pool up
+// to it. Called with dev->sem held.
+static struct scull_qset* scull_get_qset(struct scull_dev* dev, struct scull_write_pool* pool,
+                                         uint64_t item) {
+  struct scull_qset* dptr = dev->data;
+  struct scull_qset* prev = NULL;
+  uint64_t i = 0;
+
+  if (dev->cursor_qset != NULL && dev->cursor_item <= item) {
+    dptr = dev->cursor_qset;
+    i = dev->cursor_item;
+  }
+  for (;;) {
+    if (dptr == NULL) {
+      dptr = scull_pool_get_qset(pool);
+      if (dptr == NULL) {
+        return NULL;
+      }
+      dev->meta_bytes += sizeof(struct scull_qset) + scull_qset_array_bytes(dev->qset);
+      if (prev != NULL) {
+        prev->next = dptr;
+      } else {
+        dev->data = dptr;
+      }
+    }
+    if (i == item) {
+      break;
+    }
+    prev = dptr;
+    dptr = dptr->next;
+    i++;
+  }
+  if (dptr->data == NULL) {
+    // The arrays were freed by the compactor.
+    dptr->data = kvcalloc(dev->qset, sizeof(void*), GFP_KERNEL_ACCOUNT);
+    dptr->info = kvcalloc(dev->qset, sizeof(struct scull_quantum_info), GFP_KERNEL_ACCOUNT);
+    if (dptr->data == NULL || dptr->info == NULL) {
+      kvfree(dptr->data);
+      kvfree(dptr->info);
+      dptr->data = NULL;
+      dptr->info = NULL;
+      return NULL;
+    }
+    dev->meta_bytes += scull_qset_array_bytes(dev->qset);
+  }
+  dev->cursor_qset = dptr;
+  dev->cursor_item = item;
+  return dptr;
+}
+
+// Collect quanta for device positions [pos, pos + count) and their info into
+// quanta[] and infos[] of max_quanta entries, allocating missing ones. Return
+// the number collected, fewer than needed on error. Called with dev->sem held.
+static unsigned scull_get_append_quanta(struct scull_dev* dev, struct scull_write_pool* pool,
+                                        struct file* filp, uint64_t pos, size_t count,
+                                        void** quanta, struct scull_quantum_info** infos,
+                                        unsigned max_quanta, int* err) {
+  uint64_t itemsize = (uint64_t)dev->quantum * dev->qset;
+  uint64_t qpos;
+  unsigned nr = 0;
+
+  *err = 0;
+  for (qpos = pos - pos % dev->quantum; qpos < pos + count; qpos += dev->quantum) {
+    struct scull_qset* dptr = scull_get_qset(dev, pool, qpos / itemsize);
+    unsigned quantum_id = (qpos % itemsize) / dev->quantum;
+    void* q;
+
+    if (dptr == NULL || nr == max_quanta) {
+      *err = -ENOMEM;
+      break;
+    }
+    q = scull_get_quantum(dev, dptr, quantum_id);
+    if (IS_ERR(q)) {
+      *err = PTR_ERR(q);
+      break;
+    }
+    if (q == NULL) {
+      // Appenders can't wait for memory, others wait for their commit.
+      if (scull_reserve_mem(dev, filp) != 0) {
+        *err = -ENOSPC;
+        break;
+      }
+      q = scull_pool_get_quantum(pool);
+      if (q == NULL) {
+        *err = -ENOMEM;
+        break;
+      }
+      scull_add_quantum(dev, dptr, quantum_id, q, qpos);
+    }
+    infos[nr] = &dptr->info[quantum_id];
+    quanta[nr++] = q;
+  }
+  return nr;
+}
+
+static void scull_log_unpin(struct scull_dev* dev) {
+  if (atomic_dec_and_test(&dev->log_pinned)) {
+    wake_up_all(&dev->log_wq);
+  }
+}
+
+// Pin the tail quantum for res without dev->sem, if res fits in it. Return
+// false if it doesn't, or the tail changed meanwhile.
+static bool scull_log_reserve_tail(struct scull_dev* dev, struct scull_reservation* res,
+                                   uint64_t* dev_pos) {
+  struct scull_quantum_info* info;
+  uint64_t start;
+  uint64_t base;
+  unsigned quantum;
+  unsigned seq;
+  void* q;
+
+  seq = read_seqcount_begin(&dev->seq);
+  q = dev->log_tail_q;
+  info = dev->log_tail_info;
+  start = dev->log_tail_off;
+  base = dev->log_base;
+  quantum = dev->quantum;
+  if (q == NULL || res->off < start || res->off + res->len > start + quantum) {
+    return false;
+  }
+  atomic_inc(&dev->log_pinned);
+  // Pairs with the barrier in scull_trim() after it clears the tail.
+  smp_mb__after_atomic();
+  if (read_seqcount_retry(&dev->seq, seq)) {
+    scull_log_unpin(dev);
+    return false;
+  }
+  // The quantum can't be compressed, spilled or freed until res is
+  // published, see scull_quantum_busy().
+  res->data = q;
+  res->info = info;
+  res->quanta = &res->data;
+  res->infos = &res->info;
+  res->nr_quanta = 1;
+  res->quantum = quantum;
+  res->first = res->off - start;
+  *dev_pos = res->off - base;
+  return true;
+}
+
+// Reserve count bytes at the end of the device log and collect their quanta
+// into res, pinned until scull_log_commit(). res->err is set if they couldn't
+// all be allocated. Return false if the device was trimmed after the
+// reservation, else set *dev_pos to its device position. Only appends which
+// need new quanta take dev->sem. Can sleep.
+static bool scull_log_reserve(struct scull_dev* dev, struct file* filp, size_t count,
+                              struct scull_reservation* res, uint64_t* dev_pos) {
+  struct scull_write_pool pool;
+  unsigned max_quanta;
+  unsigned last;
+  uint64_t pos;
+  uint64_t tail_off;
+  u64 lock_ns;
+  bool stale;
+
+  res->len = count;
+  res->nr_quanta = 0;
+  res->first = 0;
+  res->err = 0;
+  res->record = NULL;
+  res->off = atomic64_add_return(count, &dev->log_reserved) - count;
+  if (scull_log_reserve_tail(dev, res, dev_pos)) {
+    return true;
+  }
+
+  scull_fill_write_pool(dev, &pool, res->off - READ_ONCE(dev->log_base), count);
+  max_quanta = count / pool.quantum + 2;
+  res->quanta = kvmalloc_array(max_quanta, sizeof(void*), GFP_KERNEL);
+  res->infos = kvmalloc_array(max_quanta, sizeof(struct scull_quantum_info*), GFP_KERNEL);
+
+  // The reservation has to be committed whatever happens, so don't give up
+  // on signals.
+  down(&dev->sem);
+  lock_ns = ktime_get_ns();
+  stale = res->off < dev->log_base;
+  if (!stale) {
+    if (res->quanta == NULL || res->infos == NULL) {
+      res->err = -ENOMEM;
+    } else {
+      if (pool.quantum != dev->quantum || pool.qset != dev->qset) {
+        scull_drain_write_pool(&pool);
+        pool.quantum = dev->quantum;
+        pool.qset = dev->qset;
+      }
+      pos = res->off - dev->log_base;
+      res->first = pos % pool.quantum;
+      res->nr_quanta = scull_get_append_quanta(dev, &pool, filp, pos, count, res->quanta,
+                                               res->infos, max_quanta, &res->err);
+      // The quanta of res are past the commit, so they stay.
+      scull_enforce_mem_budget(dev);
+      if (res->nr_quanta != 0) {
+        atomic_inc(&dev->log_pinned);
+      }
+      if (res->nr_quanta != 0 && res->err == 0) {
+        // Let the next appends fill the last quantum without dev->sem.
+        last = res->nr_quanta - 1;
+        tail_off = res->off - res->first + (uint64_t)last * pool.quantum;
+        if (dev->log_tail_q == NULL || tail_off > dev->log_tail_off) {
+          scull_write_seqcount_begin(dev);
+          dev->log_tail_q = res->quanta[last];
+          dev->log_tail_info = res->infos[last];
+          dev->log_tail_off = tail_off;
+          scull_write_seqcount_end(dev);
+        }
+      }
+      *dev_pos = pos;
+    }
+  }
+  scull_write_lock_held(dev, lock_ns);
+  up(&dev->sem);
+  res->quantum = pool.quantum;
+  scull_drain_write_pool(&pool);
+  return !stale;
+}
+
+// Copy from iter into res at offset. Return the number of bytes copied.
+static size_t scull_reservation_copy_iter(struct scull_reservation* res, size_t offset,
+                                          struct iov_iter* from) {
+  size_t copied = 0;
+  size_t pos = res->first + offset;
+  unsigned i;
+  unsigned qoff;
+
+  if (res->nr_quanta == 0) {
+    return 0;
+  }
+  i = pos / res->quantum;
+  qoff = pos % res->quantum;
+  while (i < res->nr_quanta && offset + copied < res->len && iov_iter_count(from) != 0) {
+    size_t len = min_t(size_t, res->quantum - qoff, res->len - offset - copied);
+    u32 crc = res->infos != NULL ? crc32c(0, (char*)res->quanta[i] + qoff, len) : 0;
+    size_t n = copy_from_iter((char*)res->quanta[i] + qoff, len, from);
+    if (res->infos != NULL) {
+      scull_update_crc(res->infos[i], res->quantum, res->quanta[i], qoff, len, crc);
+    }
+    copied += n;
+    if (n != len) {
+      break;
+    }
+    i++;
+    qoff = 0;
+  }
+  return copied;
+}
+
+// Overwrite res with a hole record, see struct scull_log_hole. Called with
+// its quanta pinned.
+static void scull_reservation_fill_hole(struct scull_reservation* res) {
+  struct scull_log_hole hole = { .magic = SCULL_LOG_HOLE_MAGIC, .reserved = 0, .len = res->len };
+  struct kvec kv = { .iov_base = &hole, .iov_len = sizeof(hole) };
+  struct iov_iter from;
+  size_t left = res->len;
+  unsigned qoff = res->first;
+  unsigned i;
+
+  for (i = 0; i < res->nr_quanta && left != 0; ++i) {
+    size_t len = min_t(size_t, res->quantum - qoff, left);
+    char* p = (char*)res->quanta[i] + qoff;
+    u32 crc = res->infos != NULL ? crc32c(0, p, len) : 0;
+
+    memset(p, 0, len);
+    if (res->infos != NULL) {
+      scull_update_crc(res->infos[i], res->quantum, res->quanta[i], qoff, len, crc);
+    }
+    left -= len;
+    qoff = 0;
+  }
+  if (res->len >= sizeof(hole)) {
+    iov_iter_kvec(&from, WRITE, &kv, 1, sizeof(hole));
+    scull_reservation_copy_iter(res, 0, &from);
+  }
+}
+
+// Called with dev->log_lock held.
+static struct scull_log_waiter* scull_log_find_waiter(struct scull_dev* dev, uint64_t off) {
+  struct scull_log_waiter* waiter;
+
+  hash_for_each_possible(dev->log_waiters, waiter, node, off) {
+    if (waiter->off == off) {
+      return waiter;
+    }
+  }
+  return NULL;
+}
+
+// Publish the log up to log offset end, and pass the turn to the appender of
+// the reservation starting there. Reservations of killed appenders are
+// published on their behalf.
+static void scull_log_advance(struct scull_dev* dev, uint64_t end) {
+  struct scull_log_waiter* waiter;
+
+  spin_lock(&dev->log_lock);
+  for (;;) {
+    atomic64_set_release(&dev->log_commit, end);
+    waiter = scull_log_find_waiter(dev, end);
+    if (waiter == NULL) {
+      break;
+    }
+    hash_del(&waiter->node);
+    if (!waiter->abandoned) {
+      waiter->ready = true;
+      wake_up_process(waiter->task);
+      break;
+    }
+    end = waiter->end;
+    kfree(waiter);
+  }
+  spin_unlock(&dev->log_lock);
+  wake_up_interruptible(&dev->size_wq);
+}
+
+// Publish res in reservation order. Failed reservations are published too,
+// as hole records, so later ones aren't blocked. An appender killed while
+// waiting for its turn publishes a hole too, or leaves it to the appender
+// before it. Sets res->err to -EINTR then. Can sleep.
+static void scull_log_commit(struct scull_dev* dev, struct scull_reservation* res) {
+  struct scull_log_waiter* waiter = NULL;
+  // Empty reservations have nothing to publish, and may share their offset
+  // with the next one.
+  bool publish = res->len != 0;
+
+  if (publish && atomic64_read_acquire(&dev->log_commit) != res->off) {
+    // It can't fail, the reservation has to be published.
+    waiter = kmalloc(sizeof(struct scull_log_waiter), GFP_KERNEL | __GFP_NOFAIL);
+    waiter->task = current;
+    waiter->off = res->off;
+    waiter->end = res->off + res->len;
+    waiter->ready = false;
+    waiter->abandoned = false;
+    spin_lock(&dev->log_lock);
+    if (atomic64_read(&dev->log_commit) == res->off) {
+      waiter->ready = true;
+    } else {
+      hash_add(dev->log_waiters, &waiter->node, res->off);
+    }
+    spin_unlock(&dev->log_lock);
+    for (;;) {
+      set_current_state(TASK_KILLABLE);
+      if (READ_ONCE(waiter->ready) || fatal_signal_pending(current)) {
+        break;
+      }
+      schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    if (!READ_ONCE(waiter->ready)) {
+      res->err = -EINTR;
+    }
+  }
+  if (res->err != 0) {
+    scull_reservation_fill_hole(res);
+  }
+  if (waiter != NULL) {
+    spin_lock(&dev->log_lock);
+    if (!waiter->ready) {
+      // The appender publishing the range before it frees waiter.
+      waiter->abandoned = true;
+      publish = false;
+    }
+    spin_unlock(&dev->log_lock);
+    if (publish) {
+      kfree(waiter);
+    }
+  }
+  if (res->nr_quanta != 0) {
+    scull_log_unpin(dev);
+  }
+  if (publish) {
+    scull_log_advance(dev, res->off + res->len);
+  }
+  if (res->quanta != &res->data) {
+    kvfree(res->quanta);
+    kvfree(res->infos);
+  }
+  res->quanta = NULL;
+  res->infos = NULL;
+}
+
+// Append count bytes from iter to the device log. Return count and set
+// *log_off to its log offset and, unless the device was trimmed meanwhile,
+// *dev_pos to its device position. Return an error if it failed, its range
+// is then a hole record in the log.
+static ssize_t scull_log_append(struct scull_dev* dev, struct file* filp, struct iov_iter* from,
+                                size_t count, uint64_t* log_off, uint64_t* dev_pos) {
+  struct scull_reservation res;
+  bool live;
+
+  iov_iter_fault_in_readable(from, min_t(size_t, count,
+                                         (size_t)SCULL_WRITE_POOL_QUANTA * READ_ONCE(dev->quantum)));
+  live = scull_log_reserve(dev, filp, count, &res, dev_pos);
+  // Copy without dev->sem, quanta in [log_commit, log_reserved) are pinned.
+  if (live && scull_reservation_copy_iter(&res, 0, from) != count && res.err == 0) {
+    res.err = -EFAULT;
+  }
+  scull_log_commit(dev, &res);
+  *log_off = res.off;
+  if (!live) {
+    // The device was trimmed after the append.
+    return count;
+  }
+  if (res.err != 0) {
+    return res.err;
+  }
+  return count;
+}
+
+static ssize_t scull_append(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos) {
+  struct scull_dev* dev = filp->private_data;
+  struct iovec iov;
+  struct iov_iter from;
+  uint64_t off;
+  uint64_t pos = U64_MAX;
+  ssize_t retval;
+
+  if (count == 0) {
+    return 0;
+  }
+  retval = import_single_range(WRITE, (char __user*)buf, count, &iov, &from);
+  if (retval != 0) {
+    return retval;
+  }
+  retval = scull_log_append(dev, filp, &from, count, &off, &pos);
+  if (retval > 0 && pos != U64_MAX) {
+    *f_pos = pos + count;
+  }
+  return retval;
+}
+
+// Kernel producer API, see scull.h. It writes to the log of scull_dev.
+
+int scull_reserve(struct scull_reservation* res, size_t len) {
+  struct scull_dev* dev = &scull_dev;
+  uint64_t pos;
+
+  might_sleep();
+  if (down_interruptible(&dev->sem)) {
+    return -ERESTARTSYS;
+  }
+  scull_activate_log(dev);
+  up(&dev->sem);
+  scull_log_reserve(dev, NULL, len, res, &pos);
+  if (res->err != 0) {
+    scull_log_commit(dev, res);
+    return res->err;
+  }
+  return 0;
+}
+EXPORT_SYMBOL_GPL(scull_reserve);
+
+int scull_reserve_atomic(struct scull_reservation* res, size_t len) {
+  struct scull_dev* dev = &scull_dev;
+  struct scull_krecord* rec;
+  size_t need;
+  size_t pos;
+  size_t pad = 0;
+  unsigned long flags;
+
+  // The record length and res->quantum are 32 bits.
+  if (len == 0 || len > U32_MAX) {
+    return -EINVAL;
+  }
+  need = sizeof(struct scull_krecord) + ALIGN(len, 8);
+  spin_lock_irqsave(&dev->kbuf_lock, flags);
+  if (dev->kbuf == NULL) {
+    spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+    return -ENOMEM;
+  }
+  if (need > dev->kbuf_size) {
+    // It would never fit.
+    spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+    return -EINVAL;
+  }
+  pos = dev->kbuf_head % dev->kbuf_size;
+  if (dev->kbuf_size - pos < need) {
+    pad = dev->kbuf_size - pos;
+  }
+  if (dev->kbuf_head + pad + need - dev->kbuf_tail > dev->kbuf_size) {
+    spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+    return -ENOSPC;
+  }
+  if (pad != 0) {
+    rec = (struct scull_krecord*)(dev->kbuf + pos);
+    rec->len = pad - sizeof(struct scull_krecord);
+    rec->flags = SCULL_KRECORD_PAD | SCULL_KRECORD_COMMITTED;
+    dev->kbuf_head += pad;
+    pos = 0;
+  }
+  rec = (struct scull_krecord*)(dev->kbuf + pos);
+  rec->len = len;
+  rec->flags = 0;
+  dev->kbuf_head += need;
+  spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+
+  res->len = len;
+  res->data = rec + 1;
+  res->quanta = &res->data;
+  res->infos = NULL;
+  res->nr_quanta = 1;
+  res->quantum = len;
+  res->first = 0;
+  res->err = 0;
+  res->record = rec;
+  return 0;
+}
+EXPORT_SYMBOL_GPL(scull_reserve_atomic);
+
+size_t scull_reservation_copy(struct scull_reservation* res, size_t offset, const void* src,
+                              size_t len) {
+  struct kvec kv = { .iov_base = (void*)src, .iov_len = len };
+  struct iov_iter from;
+
+  iov_iter_kvec(&from, WRITE, &kv, 1, len);
+  return scull_reservation_copy_iter(res, offset, &from);
+}
+EXPORT_SYMBOL_GPL(scull_reservation_copy);
+
+size_t scull_reservation_copy_bvec(struct scull_reservation* res, size_t offset,
+                                   const struct bio_vec* bvec, unsigned nr, size_t len) {
+  struct iov_iter from;
+
+  iov_iter_bvec(&from, WRITE, bvec, nr, len);
+  return scull_reservation_copy_iter(res, offset, &from);
+}
+EXPORT_SYMBOL_GPL(scull_reservation_copy_bvec);
+
+void scull_commit(struct scull_reservation* res) {
+  struct scull_dev* dev = &scull_dev;
+  struct scull_krecord* rec = res->record;
+  unsigned long flags;
+
+  if (rec == NULL) {
+    scull_log_commit(dev, res);
+    return;
+  }
+  spin_lock_irqsave(&dev->kbuf_lock, flags);
+  rec->flags |= SCULL_KRECORD_COMMITTED;
+  spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+  schedule_work(&dev->kbuf_work);
+}
+EXPORT_SYMBOL_GPL(scull_commit);
+
+int scull_prealloc_atomic(size_t bytes) {
+  struct scull_dev* dev = &scull_dev;
+  char* kbuf;
+  unsigned long flags;
+
+  might_sleep();
+  bytes = ALIGN(bytes, 8);
+  if (bytes == 0) {
+    return -EINVAL;
+  }
+  kbuf = kvmalloc(bytes, GFP_KERNEL);
+  if (kbuf == NULL) {
+    return -ENOMEM;
+  }
+  if (down_interruptible(&dev->sem)) {
+    kvfree(kbuf);
+    return -ERESTARTSYS;
+  }
+  scull_activate_log(dev);
+  up(&dev->sem);
+
+  spin_lock_irqsave(&dev->kbuf_lock, flags);
+  if (dev->kbuf != NULL) {
+    spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+    kvfree(kbuf);
+    return -EBUSY;
+  }
+  dev->kbuf = kbuf;
+  dev->kbuf_size = bytes;
+  spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+  return 0;
+}
+EXPORT_SYMBOL_GPL(scull_prealloc_atomic);
+
+ssize_t scull_kernel_write(const void* buf, size_t count) {
+  struct scull_reservation res;
+  int err;
+
+  err = scull_reserve(&res, count);
+  if (err != 0) {
+    return err;
+  }
+  scull_reservation_copy(&res, 0, buf, count);
+  scull_commit(&res);
+  return count;
+}
+EXPORT_SYMBOL_GPL(scull_kernel_write);
+
+// Append the committed records of the atomic buffer to the log, in
+// reservation order.
+static void scull_kbuf_fn(struct work_struct* work) {
+  struct scull_dev* dev = container_of(work, struct scull_dev, kbuf_work);
+  struct scull_krecord* rec;
+  unsigned long flags;
+  uint64_t off;
+  uint64_t pos;
+
+  for (;;) {
+    spin_lock_irqsave(&dev->kbuf_lock, flags);
+    if (dev->kbuf_tail == dev->kbuf_head) {
+      spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+      break;
+    }
+    rec = (struct scull_krecord*)(dev->kbuf + dev->kbuf_tail % dev->kbuf_size);
+    if (!(rec->flags & SCULL_KRECORD_COMMITTED)) {
+      // Its commit queues the work again.
+      spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+      break;
+    }
+    spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+
+    if (!(rec->flags & SCULL_KRECORD_PAD) && rec->len != 0) {
+      struct kvec kv = { .iov_base = rec + 1, .iov_len = rec->len };
+      struct iov_iter from;
+
+      iov_iter_kvec(&from, WRITE, &kv, 1, rec->len);
+      scull_log_append(dev, NULL, &from, rec->len, &off, &pos);
+    }
+
+    spin_lock_irqsave(&dev->kbuf_lock, flags);
+    dev->kbuf_tail += sizeof(struct scull_krecord) + ALIGN(rec->len, 8);
+    spin_unlock_irqrestore(&dev->kbuf_lock, flags);
+  }
+}
+
+static void scull_kv_remove(struct scull_dev* dev, struct scull_kv_slot* slot) {
+  kfree(slot->key);
+  slot->key = SCULL_KV_TOMBSTONE;
+  dev->kv_nr_live--;
+}
+
+// Return the slot of key, or NULL. A slot whose value was trimmed from the
+// device is deleted instead. Called with dev->kv_lock held.
+static struct scull_kv_slot* scull_kv_find(struct scull_dev* dev, const char* key, u32 key_len,
+                                           u32 hash) {
+  unsigned mask = dev->kv_nr_slots - 1;
+  unsigned i;
+
+  if (dev->kv_slots == NULL) {
+    return NULL;
+  }
+  for (i = hash & mask; dev->kv_slots[i].key != NULL; i = (i + 1) & mask) {
+    struct scull_kv_slot* slot = &dev->kv_slots[i];
+    if (slot->key == SCULL_KV_TOMBSTONE || slot->hash != hash || slot->key_len != key_len ||
+        memcmp(slot->key, key, key_len) != 0) {
+      continue;
+    }
+    if (slot->off < READ_ONCE(dev->log_base)) {
+      scull_kv_remove(dev, slot);
+      return NULL;
+    }
+    return slot;
+  }
+  return NULL;
+}
+
+// Rehash the live slots into nr_slots slots, dropping the deleted ones.
+// Called with dev->kv_lock held.
+static int scull_kv_resize(struct scull_dev* dev, unsigned nr_slots) {
+  struct scull_kv_slot* slots;
+  unsigned i;
+  unsigned j;
+
+  slots = kvcalloc(nr_slots, sizeof(struct scull_kv_slot), GFP_KERNEL);
+  if (slots == NULL) {
+    return -ENOMEM;
+  }
+  for (i = 0; i < dev->kv_nr_slots; ++i) {
+    struct scull_kv_slot* slot = &dev->kv_slots[i];
+    if (slot->key == NULL || slot->key == SCULL_KV_TOMBSTONE) {
+      continue;
+    }
+    for (j = slot->hash & (nr_slots - 1); slots[j].key != NULL; j = (j + 1) & (nr_slots - 1)) {
+    }
+    slots[j] = *slot;
+  }
+  kvfree(dev->kv_slots);
+  dev->kv_slots = slots;
+  dev->kv_nr_slots = nr_slots;
+  dev->kv_nr_used = dev->kv_nr_live;
+  return 0;
+}
+
+// Add key, which isn't in the index. Called with dev->kv_lock held.
+static int scull_kv_insert(struct scull_dev* dev, const char* key, u32 key_len, u32 hash,
+                           uint64_t off, uint64_t len) {
+  struct scull_kv_slot* slot;
+  unsigned mask;
+  unsigned i;
+  char* copy;
+  int err;
+
+  // Keep a quarter of the slots empty so probe sequences stay short.
+  if ((dev->kv_nr_used + 1) * 4 > dev->kv_nr_slots * 3) {
+    err = scull_kv_resize(dev, max_t(unsigned, SCULL_KV_MIN_SLOTS,
+                                     roundup_pow_of_two((dev->kv_nr_live + 1) * 2)));
+    if (err != 0) {
+      return err;
+    }
+  }
+  copy = kmemdup(key, key_len, GFP_KERNEL);
+  if (copy == NULL) {
+    return -ENOMEM;
+  }
+  mask = dev->kv_nr_slots - 1;
+  for (i = hash & mask; dev->kv_slots[i].key != NULL && dev->kv_slots[i].key != SCULL_KV_TOMBSTONE;
+       i = (i + 1) & mask) {
+  }
+  slot = &dev->kv_slots[i];
+  if (slot->key == NULL) {
+    dev->kv_nr_used++;
+  }
+  slot->key = copy;
+  slot->hash = hash;
+  slot->key_len = key_len;
+  slot->off = off;
+  slot->len = len;
+  dev->kv_nr_live++;
+  return 0;
+}
+
+static void scull_kv_free(struct scull_dev* dev) {
+  unsigned i;
+
+  for (i = 0; i < dev->kv_nr_slots; ++i) {
+    if (dev->kv_slots[i].key != SCULL_KV_TOMBSTONE) {
+      kfree(dev->kv_slots[i].key);
+    }
+  }
+  kvfree(dev->kv_slots);
+  dev->kv_slots = NULL;
+  dev->kv_nr_slots = 0;
+  dev->kv_nr_used = 0;
+  dev->kv_nr_live = 0;
+}
+
+static int scull_kv_read_key(struct scull_kv_req* req, char* key) {
+  if (req->key_len == 0 || req->key_len > SCULL_KV_MAX_KEY) {
+    return -EINVAL;
+  }
+  if (copy_from_user(key, u64_to_user_ptr(req->key), req->key_len) != 0) {
+    return -EFAULT;
+  }
+  return 0;
+}
+
+// Store the value after the device log and point the key at it. The space of
+// an overwritten value is reclaimed only by trimming the device.
+static long scull_kv_put(struct scull_dev* dev, struct file* filp, struct scull_kv_req __user* ureq) {
+  struct scull_kv_req req;
+  struct scull_kv_slot* slot;
+  char key[SCULL_KV_MAX_KEY];
+  struct iovec iov;
+  struct iov_iter from;
+  uint64_t off;
+  uint64_t pos;
+  ssize_t retval;
+  u32 hash;
+
+  if (copy_from_user(&req, ureq, sizeof(req)) != 0) {
+    return -EFAULT;
+  }
+  retval = scull_kv_read_key(&req, key);
+  if (retval != 0) {
+    return retval;
+  }
+  hash = jhash(key, req.key_len, 0);
+
+  if (down_interruptible(&dev->sem)) {
+    return -ERESTARTSYS;
+  }
+  scull_activate_log(dev);
+  up(&dev->sem);
+  off = atomic64_read(&dev->log_reserved);
+  if (req.value_len != 0) {
+    retval = import_single_range(WRITE, u64_to_user_ptr(req.value), req.value_len, &iov, &from);
+    if (retval != 0) {
+      return retval;
+    }
+    retval = scull_log_append(dev, filp, &from, req.value_len, &off, &pos);
+    if (retval < 0) {
+      return retval;
+    }
+  }
+
+  mutex_lock(&dev->kv_lock);
+  slot = scull_kv_find(dev, key, req.key_len, hash);
+  if (slot != NULL) {
+    // Concurrent puts of the key get here in any order, the value appended
+    // last wins.
+    if (off >= slot->off) {
+      slot->off = off;
+      slot->len = req.value_len;
+    }
+    retval = 0;
+  } else {
+    retval = scull_kv_insert(dev, key, req.key_len, hash, off, req.value_len);
+  }
+  mutex_unlock(&dev->kv_lock);
+  return retval;
+}
+
+// Look up the keys of reqs and copy their values out, holding dev->sem once
+// for all of them. Errors of single requests are left in their status.
+static int scull_kv_lookup(struct scull_dev* dev, struct scull_kv_req* reqs, uint64_t* offs,
+                           unsigned nr) {
+  char key[SCULL_KV_MAX_KEY];
+  unsigned i;
+
+  if (mutex_lock_interruptible(&dev->kv_lock)) {
+    return -ERESTARTSYS;
+  }
+  for (i = 0; i < nr; ++i) {
+    struct scull_kv_req* req = &reqs[i];
+    struct scull_kv_slot* slot;
+
+    req->status = scull_kv_read_key(req, key);
+    if (req->status != 0) {
+      continue;
+    }
+    slot = scull_kv_find(dev, key, req->key_len, jhash(key, req->key_len, 0));
+    if (slot == NULL) {
+      req->status = -ENOENT;
+      continue;
+    }
+    if (slot->len > req->value_len) {
+      req->status = -EMSGSIZE;
+    }
+    req->value_len = slot->len;
+    offs[i] = slot->off;
+  }
+  mutex_unlock(&dev->kv_lock);
+
+  if (down_interruptible(&dev->sem)) {
+    return -ERESTARTSYS;
+  }
+  for (i = 0; i < nr; ++i) {
+    struct scull_kv_req* req = &reqs[i];
+    ssize_t copied;
+
+    if (req->status != 0) {
+      continue;
+    }
+    // The device may have been trimmed since the lookup.
+    if (offs[i] < dev->log_base) {
+      req->status = -ENOENT;
+      continue;
+    }
+    copied = scull_copy_out(dev, u64_to_user_ptr(req->value), req->value_len,
+                            offs[i] - dev->log_base);
+    if (copied < 0) {
+      req->status = copied;
+    } else if (copied != req->value_len) {
+      req->status = -ENOENT;
+    }
+  }
+  up(&dev->sem);
+  return 0;
+}
+
+static long scull_kv_get(struct scull_dev* dev, struct scull_kv_req __user* ureq) {
+  struct scull_kv_req req;
+  uint64_t off;
+  int err;
+
+  if (copy_from_user(&req, ureq, sizeof(req)) != 0) {
+    return -EFAULT;
+  }
+  err = scull_kv_lookup(dev, &req, &off, 1);
+  if (err != 0) {
+    return err;
+  }
+  if (copy_to_user(ureq, &req, sizeof(req)) != 0) {
+    return -EFAULT;
+  }
+  return req.status;
+}
+
+static long scull_kv_multi_get(struct scull_dev* dev, struct scull_kv_batch __user* ubatch) {
+  struct scull_kv_batch batch;
+  struct scull_kv_req* reqs;
+  uint64_t* offs;
+  long retval;
+
+  if (copy_from_user(&batch, ubatch, sizeof(batch)) != 0) {
+    return -EFAULT;
+  }
+  if (batch.nr == 0 || batch.nr > SCULL_KV_MAX_BATCH) {
+    return -EINVAL;
+  }
+  reqs = kmalloc_array(batch.nr, sizeof(struct scull_kv_req), GFP_KERNEL);
+  if (reqs == NULL) {
+    retval = -ENOMEM;
+    goto error_alloc_reqs;
+  }
+  offs = kmalloc_array(batch.nr, sizeof(uint64_t), GFP_KERNEL);
+  if (offs == NULL) {
+    retval = -ENOMEM;
+    goto error_alloc_offs;
+  }
+  if (copy_from_user(reqs, u64_to_user_ptr(batch.reqs), batch.nr * sizeof(struct scull_kv_req)) != 0) {
+    retval = -EFAULT;
+    goto out;
+  }
+  retval = scull_kv_lookup(dev, reqs, offs, batch.nr);
+  if (retval != 0) {
+    goto out;
+  }
+  if (copy_to_user(u64_to_user_ptr(batch.reqs), reqs, batch.nr * sizeof(struct scull_kv_req)) != 0) {
+    retval = -EFAULT;
+  }
+out:
+  kfree(offs);
+error_alloc_offs:
+  kfree(reqs);
+error_alloc_reqs:
+  return retval;
+}
+
+static long scull_kv_delete(struct scull_dev* dev, struct scull_kv_req __user* ureq) {
+  struct scull_kv_req req;
+  struct scull_kv_slot* slot;
+  char key[SCULL_KV_MAX_KEY];
+  long retval;
+
+  if (copy_from_user(&req, ureq, sizeof(req)) != 0) {
+    return -EFAULT;
+  }
+  retval = scull_kv_read_key(&req, key);
+  if (retval != 0) {
+    return retval;
+  }
+  if (mutex_lock_interruptible(&dev->kv_lock)) {
+    return -ERESTARTSYS;
+  }
+  slot = scull_kv_find(dev, key, req.key_len, jhash(key, req.key_len, 0));
+  if (slot != NULL) {
+    scull_kv_remove(dev, slot);
+  } else {
+    retval = -ENOENT;
+  }
+  mutex_unlock(&dev->kv_lock);
+  return retval;
+}
+
+// Take the log up to device position end from the appenders for a
+// positional write, like a reservation published once the write is done.
+// Only possible with no append in flight, else fail with -EBUSY. Set *claim
+// to the log offset to publish, or 0 if the write stays below the log
+// commit. Called with dev->sem held.
+static int scull_log_claim(struct scull_dev* dev, uint64_t end, uint64_t* claim) {
+  uint64_t off = dev->log_base + end;
+  uint64_t reserved;
+
+  *claim = 0;
+  if (!dev->log_active || off <= atomic64_read_acquire(&dev->log_commit)) {
+    return 0;
+  }
+  // Appends in flight are all published once the commit reaches reserved.
+  reserved = atomic64_read(&dev->log_reserved);
+  if (atomic64_read_acquire(&dev->log_commit) != reserved ||
+      atomic64_cmpxchg(&dev->log_reserved, reserved, off) != reserved) {
+    return -EBUSY;
+  }
+  *claim = off;
+  return 0;
+}
+
+static ssize_t scull_write(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos) {
+  struct scull_dev* dev = filp->private_data;
+  struct scull_qset* dptr, *prev_qset;
+  struct scull_write_pool pool;
+  unsigned quantum;
+  unsigned qset;
+  uint64_t itemsize;
+  uint64_t last_pos;
+  uint64_t claim = 0;
+  size_t last_count;
+  u64 lock_ns;
+  int retval = 0;
+
+  if (filp->f_flags & O_APPEND) {
+    return scull_append(filp, buf, count, f_pos);
+  }
+
+  // Do the slow parts without dev->sem: allocate quanta and fault in the
+  // user buffer. With dev->sem held, only link pointers and copy data.
+  scull_fill_write_pool(dev, &pool, *f_pos, count);
+  // The bound is in size_t, and fault_in_pages_readable() takes an int.
+  fault_in_pages_readable(buf, min3(count, (size_t)SCULL_WRITE_POOL_QUANTA * pool.quantum,
+                                    (size_t)INT_MAX));
+
+  if (down_interruptible(&dev->sem)) {
+    retval = -ERESTARTSYS;
+    goto out_drain;
+  }
+  lock_ns = ktime_get_ns();
+  // Appends reserved later mustn't overwrite the data.
+  retval = scull_log_claim(dev, *f_pos + count, &claim);
+  if (retval != 0) {
+    goto out;
+  }
+restart:
+  lock_ns = ktime_get_ns();
+  if (pool.quantum != dev->quantum || pool.qset != dev->qset) {
+    // The device was trimmed with a new geometry.
+    scull_drain_write_pool(&pool);
+    pool.quantum = dev->quantum;
+    pool.qset = dev->qset;
+  }
+  quantum = dev->quantum;
+  qset = dev->qset;
+  itemsize = (uint64_t)quantum * qset;
+  last_pos = *f_pos;
+
+  pr_alert("scull_write\n");
+
+  prev_qset = NULL;
+  for (dptr = dev->data; dptr != NULL; dptr = dptr->next) {
+    if (last_pos < itemsize) {
+      break;
+    }
+    last_pos -= itemsize;
+    prev_qset = dptr;
+  }
+
+  last_count = count;
+  while (last_count != 0) {
+    unsigned quantum_id;
+    void* q;
+    char* p;
+    unsigned copy_count;
+    unsigned long uncopied;
+    u32 crc;
+    if (dptr == NULL) {
+      dptr = scull_pool_get_qset(&pool);
+      if (dptr == NULL) {
+        retval = -ENOMEM;
+        goto out;
+      }
+      dev->meta_bytes += sizeof(struct scull_qset) + scull_qset_array_bytes(qset);
+      if (prev_qset != NULL) {
+        prev_qset->next = dptr;
+      } else {
+        dev->data = dptr;
+      }
+    }
+    if (last_pos >= itemsize) {
+      // Writing past the last qset, link empty qsets up to the write position.
+      prev_qset = dptr;
+      dptr = dptr->next;
+      last_pos -= itemsize;
+      continue;
+    }
+    if (dptr->data == NULL) {
+      // The arrays were freed by the compactor.
+      dptr->data = kvcalloc(qset, sizeof(void*), GFP_KERNEL_ACCOUNT);
+      dptr->info = kvcalloc(qset, sizeof(struct scull_quantum_info), GFP_KERNEL_ACCOUNT);
+      if (dptr->data == NULL || dptr->info == NULL) {
+        kvfree(dptr->data);
+        kvfree(dptr->info);
+        dptr->data = NULL;
+        dptr->info = NULL;
+        retval = -ENOMEM;
+        goto out;
       }
-      memset(data, 0, qset * sizeof(void*));
-      dptr->data = data;
+      dev->meta_bytes += scull_qset_array_bytes(qset);
     }
     quantum_id = last_pos / quantum;
-    if (data[quantum_id] == NULL) {
-      data[quantum_id] = kmalloc(quantum, GFP_KERNEL);
-      if (data[quantum_id] == NULL) {
+    q = scull_get_quantum(dev, dptr, quantum_id);
+    if (IS_ERR(q)) {
+      retval = PTR_ERR(q);
+      goto out;
+    }
+    if (q == NULL) {
+      retval = scull_reserve_mem(dev, filp);
+      if (retval != 0) {
+        if (last_count != count) {
+          // Return what has been written.
+          break;
+        }
+        if (retval < 0) {
+          goto out;
+        }
+        scull_write_lock_held(dev, lock_ns);
+        up(&dev->sem);
+        if (wait_event_interruptible(dev->mem_wq, scull_has_mem_room(dev) || !dev->mem_block)) {
+          retval = -ERESTARTSYS;
+          goto out_drain;
+        }
+        if (down_interruptible(&dev->sem)) {
+          retval = -ERESTARTSYS;
+          goto out_drain;
+        }
+        goto restart;
+      }
+      q = scull_pool_get_quantum(&pool);
+      if (q == NULL) {
         retval = -ENOMEM;
         goto out;
       }
-      memset(data[quantum_id], 0, sizeof(quantum));
+      scull_add_quantum(dev, dptr, quantum_id, q, *f_pos + count - last_count - last_pos % quantum);
     }
-    p = (char*)data[quantum_id] + last_pos % quantum;
+    p = (char*)q + last_pos % quantum;
     copy_count = quantum - last_pos % quantum;
     if (copy_count > last_count) {
       copy_count = last_count;
     }
-    if (copy_from_user(p, buf, copy_count) != 0) {
+    crc = crc32c(0, p, copy_count);
+    uncopied = copy_from_user(p, buf, copy_count);
+    scull_update_crc(&dptr->info[quantum_id], quantum, q, last_pos % quantum, copy_count, crc);
+    if (uncopied != 0) {
       retval = -EFAULT;
       goto out;
     }
@@ -401,17 +2641,526 @@ static ssize_t scull_write(struct file* filp, const char __user* buf, size_t cou
   retval = count - last_count;
   *f_pos += retval;
   if (*f_pos > dev->size) {
+    scull_write_seqcount_begin(dev);
     dev->size = *f_pos;
+    scull_write_seqcount_end(dev);
+    wake_up_interruptible(&dev->size_wq);
   }
+  scull_enforce_mem_budget(dev);
   pr_alert("scull_write, count = %zu, retval = %d, *f_pos = %lld, size = %llu\n",
            count, retval, *f_pos, dev->size);
 
 out:
+  scull_write_lock_held(dev, lock_ns);
+  up(&dev->sem);
+out_drain:
+  // Publish the claimed range even if the write failed, later appends wait
+  // for it.
+  if (claim != 0) {
+    scull_log_advance(dev, claim);
+  }
+  scull_drain_write_pool(&pool);
+  return retval;
+}
+
+struct scull_image_load {
+  struct scull_dev* dev;
+  struct file* filp;
+  uint64_t size;
+  // Qsets of the image, private to the load until they are read, so the
+  // shrinker, compressor and compactor don't see them meanwhile.
+  struct scull_qset* data;
+  // All quanta of the image and their info, in device order.
+  void** quanta;
+  struct scull_quantum_info** infos;
+  uint64_t nr_quanta;
+  unsigned quantum;
+  unsigned qset;
+  unsigned chunk_quanta;
+  atomic64_t next_chunk;
+  atomic_t err;
+};
+
+struct scull_image_worker {
+  struct work_struct work;
+  struct scull_image_load* load;
+};
+
+static unsigned scull_image_chunk_quanta(unsigned quantum) {
+  return max_t(unsigned, 1, SCULL_IMAGE_CHUNK / quantum);
+}
+
+// Read chunks of the image until there is none left. Each chunk is read
+// straight into its quanta with one vectored read.
+static void scull_image_load_fn(struct work_struct* work) {
+  struct scull_image_worker* worker = container_of(work, struct scull_image_worker, work);
+  struct scull_image_load* load = worker->load;
+  struct kvec* kvecs;
+
+  kvecs = kvmalloc_array(load->chunk_quanta, sizeof(struct kvec), GFP_KERNEL);
+  if (kvecs == NULL) {
+    atomic_cmpxchg(&load->err, 0, -ENOMEM);
+    return;
+  }
+  while (atomic_read(&load->err) == 0) {
+    uint64_t first = (atomic64_inc_return(&load->next_chunk) - 1) * load->chunk_quanta;
+    struct iov_iter iter;
+    loff_t pos = first * load->quantum;
+    size_t len = 0;
+    unsigned nr;
+    unsigned i;
+
+    if (first >= load->nr_quanta) {
+      break;
+    }
+    nr = min_t(uint64_t, load->chunk_quanta, load->nr_quanta - first);
+    for (i = 0; i < nr; ++i) {
+      kvecs[i].iov_base = load->quanta[first + i];
+      kvecs[i].iov_len = min_t(uint64_t, load->quantum, load->size - pos - len);
+      len += kvecs[i].iov_len;
+    }
+    iov_iter_kvec(&iter, READ, kvecs, nr, len);
+    while (iov_iter_count(&iter) != 0) {
+      ssize_t ret = vfs_iter_read(load->filp, &iter, &pos, 0);
+      if (ret <= 0) {
+        atomic_cmpxchg(&load->err, 0, ret < 0 ? ret : -EIO);
+        break;
+      }
+    }
+    for (i = 0; i < nr; ++i) {
+      atomic_set(&load->infos[first + i]->crc, crc32c(0, load->quanta[first + i], load->quantum));
+    }
+  }
+  kvfree(kvecs);
+}
+
+// Allocate the qsets and quanta of a device of size bytes into load->data,
+// and collect the quanta into load.
+static int scull_image_alloc(struct scull_dev* dev, struct scull_image_load* load) {
+  struct scull_qset** tail = &load->data;
+  uint64_t pos = 0;
+  uint64_t n = 0;
+
+  load->nr_quanta = DIV_ROUND_UP_ULL(load->size, load->quantum);
+  if (dev->mem_limit != 0 && load->nr_quanta * load->quantum > dev->mem_limit) {
+    return -ENOSPC;
+  }
+  load->quanta = kvmalloc_array(load->nr_quanta, sizeof(void*), GFP_KERNEL);
+  load->infos = kvmalloc_array(load->nr_quanta, sizeof(struct scull_quantum_info*), GFP_KERNEL);
+  if (load->quanta == NULL || load->infos == NULL) {
+    return -ENOMEM;
+  }
+  while (pos < load->size) {
+    struct scull_qset* dptr = scull_alloc_qset(load->qset);
+    unsigned i;
+
+    if (dptr == NULL) {
+      return -ENOMEM;
+    }
+    *tail = dptr;
+    tail = &dptr->next;
+    for (i = 0; i < load->qset && pos < load->size; ++i, pos += load->quantum) {
+      // Only the tail of the last quantum isn't read from the image.
+      void* q = pos + load->quantum > load->size ? kzalloc(load->quantum, GFP_KERNEL_ACCOUNT)
+                                                 : kmalloc(load->quantum, GFP_KERNEL_ACCOUNT);
+      if (q == NULL) {
+        return -ENOMEM;
+      }
+      dptr->data[i] = q;
+      load->infos[n] = &dptr->info[i];
+      load->quanta[n++] = q;
+    }
+  }
+  return 0;
+}
+
+// Link the loaded qsets into the empty device, and account their quanta.
+static int scull_image_publish(struct scull_dev* dev, struct scull_image_load* load) {
+  struct scull_qset* dptr;
+  uint64_t pos = 0;
+  unsigned i;
+
+  down(&dev->sem);
+  if (dev->data != NULL || scull_dev_size(dev) != 0 || dev->quantum != load->quantum ||
+      dev->qset != load->qset) {
+    // A kernel producer appended meanwhile.
+    up(&dev->sem);
+    return -EBUSY;
+  }
+  for (dptr = load->data; dptr != NULL; dptr = dptr->next) {
+    dev->meta_bytes += sizeof(struct scull_qset) + scull_qset_array_bytes(load->qset);
+    for (i = 0; i < load->qset && pos < load->size; ++i, pos += load->quantum) {
+      // Keep the checksum computed by the loader.
+      u32 crc = atomic_read(&dptr->info[i].crc);
+      scull_add_quantum(dev, dptr, i, dptr->data[i], pos);
+      atomic_set(&dptr->info[i].crc, crc);
+    }
+  }
+  dev->data = load->data;
+  load->data = NULL;
+  scull_write_seqcount_begin(dev);
+  dev->size = load->size;
+  scull_write_seqcount_end(dev);
+  scull_enforce_mem_budget(dev);
+  up(&dev->sem);
+  return 0;
+}
+
+// Fill the empty device from scull_image with scull_image_workers parallel
+// readers. A missing image leaves the device empty.
+static int scull_load_image(struct scull_dev* dev) {
+  struct scull_image_load load;
+  struct scull_image_worker* workers = NULL;
+  struct workqueue_struct* wq = NULL;
+  unsigned nr_workers = max_t(unsigned, 1, scull_image_workers);
+  unsigned i;
+  u64 start_ns = ktime_get_ns();
+  int err;
+
+  if (scull_image == NULL) {
+    return 0;
+  }
+  load.filp = filp_open(scull_image, O_RDONLY | O_LARGEFILE, 0);
+  if (IS_ERR(load.filp)) {
+    err = PTR_ERR(load.filp);
+    if (err == -ENOENT) {
+      pr_alert("no image %s, starting empty\n", scull_image);
+      return 0;
+    }
+    return err;
+  }
+  load.dev = dev;
+  load.size = i_size_read(file_inode(load.filp));
+  load.data = NULL;
+  load.quanta = NULL;
+  load.infos = NULL;
+  load.quantum = READ_ONCE(dev->quantum);
+  load.qset = READ_ONCE(dev->qset);
+  atomic64_set(&load.next_chunk, 0);
+  atomic_set(&load.err, 0);
+
+  err = scull_image_alloc(dev, &load);
+  if (err != 0 || load.size == 0) {
+    goto out;
+  }
+  load.chunk_quanta = scull_image_chunk_quanta(load.quantum);
+
+  wq = alloc_workqueue("scull_image", WQ_UNBOUND, nr_workers);
+  workers = kcalloc(nr_workers, sizeof(struct scull_image_worker), GFP_KERNEL);
+  if (wq == NULL || workers == NULL) {
+    err = -ENOMEM;
+    goto out;
+  }
+  for (i = 0; i < nr_workers; ++i) {
+    workers[i].load = &load;
+    INIT_WORK(&workers[i].work, scull_image_load_fn);
+    queue_work(wq, &workers[i].work);
+  }
+  flush_workqueue(wq);
+  err = atomic_read(&load.err);
+  if (err == 0) {
+    err = scull_image_publish(dev, &load);
+  }
+  if (err == 0) {
+    pr_alert("loaded %llu bytes from %s in %llu ms\n", load.size, scull_image,
+             (ktime_get_ns() - start_ns) / NSEC_PER_MSEC);
+  }
+
+out:
+  if (wq != NULL) {
+    destroy_workqueue(wq);
+  }
+  kfree(workers);
+  kvfree(load.quanta);
+  kvfree(load.infos);
+  scull_free_qsets(load.data, load.qset);
+  filp_close(load.filp, NULL);
+  return err;
+}
+
+// Rename the temporary image filp over scull_image, in the same directory.
+static int scull_image_replace(struct file* filp) {
+  struct dentry* dentry = filp->f_path.dentry;
+  struct dentry* dir = dget_parent(dentry);
+  const char* name = kbasename(scull_image);
+  struct dentry* target;
+  int err;
+
+  lock_rename(dir, dir);
+  if (dentry->d_parent != dir || d_unhashed(dentry)) {
+    // The temporary file was moved or removed meanwhile.
+    err = -ENOENT;
+    goto out;
+  }
+  target = lookup_one_len(name, dir, strlen(name));
+  if (IS_ERR(target)) {
+    err = PTR_ERR(target);
+    goto out;
+  }
+  err = vfs_rename(d_inode(dir), dentry, d_inode(dir), target, NULL, 0);
+  dput(target);
+out:
+  unlock_rename(dir, dir);
+  dput(dir);
+  return err;
+}
+
+// Write the device to scull_image. The copy goes to scull_image.tmp first,
+// and replaces scull_image once synced, so a failed snapshot leaves the old
+// image. dev->sem is held while copying so the image is consistent, appends
+// in flight are left out. Compressed and spilled quanta are read into
+// scratch buffers, and stay as they are.
+static long scull_snapshot(struct scull_dev* dev) {
+  struct scull_qset* dptr;
+  struct kvec* kvecs = NULL;
+  struct file* filp;
+  char* tmp_name;
+  void* zero = NULL;
+  char* scratch = NULL;
+  void* zbuf = NULL;
+  unsigned chunk_quanta;
+  unsigned quantum;
+  unsigned nr = 0;
+  unsigned i = 0;
+  uint64_t size;
+  uint64_t pos;
+  loff_t wpos = 0;
+  long retval = 0;
+
+  if (!capable(CAP_SYS_ADMIN)) {
+    return -EPERM;
+  }
+  if (scull_image == NULL) {
+    return -EINVAL;
+  }
+  tmp_name = kasprintf(GFP_KERNEL, "%s.tmp", scull_image);
+  if (tmp_name == NULL) {
+    return -ENOMEM;
+  }
+  // Snapshots share the temporary file.
+  if (mutex_lock_interruptible(&dev->snapshot_lock)) {
+    retval = -ERESTARTSYS;
+    goto error_lock;
+  }
+  filp = filp_open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+  if (IS_ERR(filp)) {
+    retval = PTR_ERR(filp);
+    goto error_open;
+  }
+  if (down_interruptible(&dev->sem)) {
+    retval = -ERESTARTSYS;
+    goto error_down;
+  }
+  quantum = dev->quantum;
+  chunk_quanta = scull_image_chunk_quanta(quantum);
+  kvecs = kvmalloc_array(chunk_quanta, sizeof(struct kvec), GFP_KERNEL);
+  if (kvecs == NULL) {
+    retval = -ENOMEM;
+    goto out;
+  }
+  if (dev->nr_compressed != 0 || dev->nr_spilled != 0) {
+    scratch = kvmalloc_array(chunk_quanta, quantum, GFP_KERNEL);
+    zbuf = kmalloc(quantum, GFP_KERNEL);
+    if (scratch == NULL || zbuf == NULL) {
+      retval = -ENOMEM;
+      goto out;
+    }
+  }
+  size = scull_dev_size(dev);
+  dptr = dev->data;
+  for (pos = 0; pos < size; pos += quantum) {
+    void* q = NULL;
+
+    if (dptr != NULL && dptr->data != NULL) {
+      // scratch is only used when there are compressed or spilled quanta.
+      q = scull_peek_quantum(dev, dptr, i, scratch != NULL ? scratch + (size_t)nr * quantum : NULL,
+                             zbuf);
+      if (IS_ERR(q)) {
+        retval = PTR_ERR(q);
+        goto out;
+      }
+    }
+    if (q == NULL) {
+      if (zero == NULL) {
+        zero = kzalloc(quantum, GFP_KERNEL);
+        if (zero == NULL) {
+          retval = -ENOMEM;
+          goto out;
+        }
+      }
+      q = zero;
+    }
+    kvecs[nr].iov_base = q;
+    kvecs[nr].iov_len = min_t(uint64_t, quantum, size - pos);
+    nr++;
+    if (nr == chunk_quanta || pos + quantum >= size) {
+      struct iov_iter iter;
+      iov_iter_kvec(&iter, WRITE, kvecs, nr, (pos - wpos) + kvecs[nr - 1].iov_len);
+      while (iov_iter_count(&iter) != 0) {
+        ssize_t ret = vfs_iter_write(filp, &iter, &wpos, 0);
+        if (ret <= 0) {
+          retval = ret < 0 ? ret : -EIO;
+          goto out;
+        }
+      }
+      nr = 0;
+    }
+    if (++i == dev->qset) {
+      i = 0;
+      if (dptr != NULL) {
+        dptr = dptr->next;
+      }
+    }
+  }
+
+out:
+  up(&dev->sem);
+  if (retval == 0) {
+    retval = vfs_fsync(filp, 0);
+  }
+  if (retval == 0) {
+    retval = scull_image_replace(filp);
+  }
+error_down:
+  filp_close(filp, NULL);
+error_open:
+  mutex_unlock(&dev->snapshot_lock);
+error_lock:
+  kfree(tmp_name);
+  kfree(zero);
+  kfree(zbuf);
+  kvfree(scratch);
+  kvfree(kvecs);
+  return retval;
+}
+
+static long scull_checksum(struct scull_dev* dev, struct scull_csum_req __user* ureq) {
+  struct scull_csum_req req;
+  struct scull_qset* dptr;
+  u32* crcs = NULL;
+  // Compressed and spilled quanta are verified from copies, and stay so.
+  void* buf = NULL;
+  void* zbuf = NULL;
+  uint64_t first;
+  uint64_t nr_quanta;
+  uint64_t item;
+  unsigned quantum;
+  unsigned n;
+  unsigned i;
+  long retval = 0;
+
+  if (copy_from_user(&req, ureq, sizeof(req)) != 0) {
+    return -EFAULT;
+  }
+  if (req.nr == 0 || req.nr > SCULL_CSUM_MAX_QUANTA || (req.flags & ~SCULL_CSUM_VERIFY) != 0) {
+    return -EINVAL;
+  }
+  if (req.crcs != 0) {
+    crcs = kvmalloc_array(req.nr, sizeof(u32), GFP_KERNEL);
+    if (crcs == NULL) {
+      return -ENOMEM;
+    }
+  }
+  if (down_interruptible(&dev->sem)) {
+    retval = -ERESTARTSYS;
+    goto error_down;
+  }
+  quantum = dev->quantum;
+  if (req.flags & SCULL_CSUM_VERIFY) {
+    buf = kvmalloc(quantum, GFP_KERNEL);
+    zbuf = kvmalloc(quantum, GFP_KERNEL);
+    if (buf == NULL || zbuf == NULL) {
+      retval = -ENOMEM;
+      goto out;
+    }
+  }
+  first = req.pos / quantum;
+  nr_quanta = DIV_ROUND_UP_ULL(scull_dev_size(dev), quantum);
+  n = first < nr_quanta ? min_t(uint64_t, req.nr, nr_quanta - first) : 0;
+  req.quantum = quantum;
+  req.range_crc = 0;
+  req.nr_bad = 0;
+  req.first_bad = 0;
+
+  dptr = dev->data;
+  for (item = first / dev->qset; dptr != NULL && item != 0; --item) {
+    dptr = dptr->next;
+  }
+  for (i = 0; i < n; ++i) {
+    unsigned quantum_id = (first + i) % dev->qset;
+    u32 crc = 0;
+
+    if (i != 0 && quantum_id == 0 && dptr != NULL) {
+      dptr = dptr->next;
+    }
+    if (dptr != NULL && dptr->info != NULL) {
+      struct scull_quantum_info* info = &dptr->info[quantum_id];
+      crc = atomic_read(&info->crc);
+      // Quanta still being appended to aren't verified.
+      if ((req.flags & SCULL_CSUM_VERIFY) && !scull_quantum_busy(dev, info)) {
+        void* q = scull_peek_quantum(dev, dptr, quantum_id, buf, zbuf);
+        if (IS_ERR(q)) {
+          retval = PTR_ERR(q);
+          goto out;
+        }
+        if (crc != (q != NULL ? crc32c(0, q, quantum) : 0) && req.nr_bad++ == 0) {
+          req.first_bad = (first + i) * quantum;
+        }
+      }
+    }
+    if (crcs != NULL) {
+      crcs[i] = crc;
+    }
+    req.range_crc = __crc32c_le_shift(req.range_crc, quantum) ^ crc;
+  }
+  req.nr = n;
+
+out:
+  up(&dev->sem);
+  kvfree(buf);
+  kvfree(zbuf);
+  if (retval == 0 && crcs != NULL &&
+      copy_to_user(u64_to_user_ptr(req.crcs), crcs, n * sizeof(u32)) != 0) {
+    retval = -EFAULT;
+  }
+  if (retval == 0 && copy_to_user(ureq, &req, sizeof(req)) != 0) {
+    retval = -EFAULT;
+  }
+error_down:
+  kvfree(crcs);
+  return retval;
+}
+
+// Set the memory limit or the blocking of the device, and return the old
+// value. The quota guards the system against its writers, so only a
+// privileged writer can change it.
+static long scull_set_mem_quota(struct scull_dev* dev, struct file* filp, unsigned int cmd,
+                                unsigned long arg) {
+  long retval;
+
+  if (!(filp->f_mode & FMODE_WRITE)) {
+    return -EBADF;
+  }
+  if (!capable(CAP_SYS_RESOURCE)) {
+    return -EPERM;
+  }
+  if (down_interruptible(&dev->sem)) {
+    return -ERESTARTSYS;
+  }
+  if (cmd == SCULL_IOC_SET_MEM_LIMIT) {
+    retval = dev->mem_limit;
+    WRITE_ONCE(dev->mem_limit, arg);
+  } else {
+    retval = dev->mem_block;
+    WRITE_ONCE(dev->mem_block, arg != 0);
+  }
   up(&dev->sem);
+  wake_up_interruptible(&dev->mem_wq);
   return retval;
 }
 
 static long scull_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+  struct scull_dev* dev = filp->private_data;
   long retval = 0;
 
   if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC ||
@@ -437,13 +3186,81 @@ static long scull_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
       retval = scull_qset;
       scull_qset = arg;
       break;
+    case SCULL_IOC_GET_MEM_LIMIT:
+      retval = READ_ONCE(dev->mem_limit);
+      break;
+    case SCULL_IOC_GET_MEM_BLOCK:
+      retval = READ_ONCE(dev->mem_block);
+      break;
+    case SCULL_IOC_SET_MEM_LIMIT:
+    case SCULL_IOC_SET_MEM_BLOCK:
+      retval = scull_set_mem_quota(dev, filp, cmd, arg);
+      break;
+    case SCULL_IOC_GET_SIZE:
+      retval = scull_dev_size(dev);
+      break;
+    // Like read() and write(), the key-value commands need the file opened
+    // for reading or writing.
+    case SCULL_IOC_KV_PUT:
+      if (!(filp->f_mode & FMODE_WRITE)) {
+        return -EBADF;
+      }
+      retval = scull_kv_put(dev, filp, (void __user*)arg);
+      break;
+    case SCULL_IOC_KV_GET:
+      if (!(filp->f_mode & FMODE_READ)) {
+        return -EBADF;
+      }
+      retval = scull_kv_get(dev, (void __user*)arg);
+      break;
+    case SCULL_IOC_KV_DELETE:
+      if (!(filp->f_mode & FMODE_WRITE)) {
+        return -EBADF;
+      }
+      retval = scull_kv_delete(dev, (void __user*)arg);
+      break;
+    case SCULL_IOC_KV_MULTI_GET:
+      if (!(filp->f_mode & FMODE_READ)) {
+        return -EBADF;
+      }
+      retval = scull_kv_multi_get(dev, (void __user*)arg);
+      break;
+    case SCULL_IOC_SNAPSHOT:
+      retval = scull_snapshot(dev);
+      break;
+    case SCULL_IOC_CHECKSUM:
+      retval = scull_checksum(dev, (void __user*)arg);
+      break;
     default:
       retval = -ENOTTY;
   }
   return retval;
 }
 
-static int scull_proc_open(struct inode* inode, struct file* filp);
+static unsigned int scull_poll(struct file* filp, struct poll_table_struct* poll_table) {
+  struct scull_dev* dev = filp->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(filp, &dev->size_wq, poll_table);
+  poll_wait(filp, &dev->mem_wq, poll_table);
+  if (filp->f_pos < scull_dev_size(dev)) {
+    mask |= POLLIN | POLLRDNORM;
+  }
+  if (!READ_ONCE(dev->mem_block) || scull_has_mem_room(dev)) {
+    mask |= POLLOUT | POLLWRNORM;
+  }
+  return mask;
+}
+
+// Where a /proc/scull_device reader stopped, valid while gen matches
+// dev->layout_gen.
+struct scull_seq_cursor {
+  struct scull_qset* dptr;
+  uint64_t item;
+  unsigned long gen;
+  unsigned nr_shown;
+};
+
 static void* scull_seq_start(struct seq_file* m, loff_t* pos);
 static void scull_seq_stop(struct seq_file* m, void* v);
 static void* scull_seq_next(struct seq_file* m, void* v, loff_t* pos);
@@ -457,49 +3274,139 @@ static struct seq_operations seq_ops = {
 };
 
 static int scull_proc_open(struct inode* inode, struct file* filp) {
-  return seq_open(filp, &seq_ops);
+  return seq_open_private(filp, &seq_ops, sizeof(struct scull_seq_cursor));
 }
 
+// Return the qset at index item, or NULL past the end of the list. Called
+// with dev->sem held.
+static struct scull_qset* scull_seq_find(struct scull_dev* dev, struct scull_seq_cursor* cursor,
+                                         uint64_t item) {
+  struct scull_qset* dptr = dev->data;
+  uint64_t i = 0;
+
+  if (cursor->dptr != NULL && cursor->gen == dev->layout_gen && cursor->item <= item) {
+    dptr = cursor->dptr;
+    i = cursor->item;
+  }
+  while (dptr != NULL && i < item) {
+    dptr = dptr->next;
+    i++;
+  }
+  if (dptr != NULL) {
+    cursor->dptr = dptr;
+    cursor->item = i;
+    cursor->gen = dev->layout_gen;
+  }
+  return dptr;
+}
+
+// Position 0 is the device header, position n > 0 is qset n - 1. dev->sem is
+// held from start to stop only, so writers run between chunks.
 static void* scull_seq_start(struct seq_file* m, loff_t* pos) {
-  if (*pos > 0) {
-    return NULL;
+  struct scull_seq_cursor* cursor = m->private;
+
+  if (down_interruptible(&scull_dev.sem)) {
+    return ERR_PTR(-ERESTARTSYS);
   }
-  return &scull_dev;
+  cursor->nr_shown = 0;
+  if (*pos == 0) {
+    return SEQ_START_TOKEN;
+  }
+  return scull_seq_find(&scull_dev, cursor, *pos - 1);
 }
 
 static void scull_seq_stop(struct seq_file* m, void* v) {
-
+  if (!IS_ERR(v)) {
+    up(&scull_dev.sem);
+  }
 }
 
 static void* scull_seq_next(struct seq_file* m, void* v, loff_t* pos) {
+  struct scull_seq_cursor* cursor = m->private;
+
   ++*pos;
-  return NULL;
+  if (++cursor->nr_shown >= SCULL_SEQ_CHUNK) {
+    // End this read, the next one resumes at *pos.
+    return NULL;
+  }
+  return scull_seq_find(&scull_dev, cursor, *pos - 1);
 }
 
-static int scull_seq_show(struct seq_file* m, void* v) {
-  struct scull_dev* dev = v;
-  struct scull_qset* dptr;
+static void scull_seq_show_header(struct seq_file* m, struct scull_dev* dev) {
   unsigned i;
 
-  if (down_interruptible(&dev->sem)) {
-    return -ERESTARTSYS;
-  }
-
   seq_printf(m, "Device (%d,%d): qset %u, quantum %u, size %llu\n",
              MAJOR(dev->cdev.dev), MINOR(dev->cdev.dev), dev->qset,
-             dev->quantum, dev->size);
-  for (dptr = dev->data; dptr != NULL; dptr = dptr->next) {
-    seq_printf(m, "  item at %p, qset at %p\n", dptr, dptr->data);
-    // Dump only the least item.
-    if (dptr->data && dptr->next == NULL) {
-      for (i = 0; i < dev->qset; ++i) {
-        seq_printf(m, "    %4u: %8p\n", i, dptr->data[i]);
-      }
+             dev->quantum, scull_dev_size(dev));
+  seq_printf(m, "  memory: usage %llu, peak %llu, limit %lu (%s)\n", dev->mem_bytes, dev->mem_peak,
+             dev->mem_limit, dev->mem_block ? "block" : "enospc");
+  seq_printf(m, "  layout: data %llu bytes, metadata %llu bytes\n", dev->mem_bytes, dev->meta_bytes);
+  seq_printf(m, "  write lock hold (prealloc %s):\n", scull_write_prealloc ? "on" : "off");
+  for (i = 0; i < SCULL_HIST_BUCKETS; ++i) {
+    if (dev->write_hold_hist[i] != 0) {
+      seq_printf(m, "    %s %llu ns: %lu\n", i + 1 < SCULL_HIST_BUCKETS ? "<" : ">=",
+                 i + 1 < SCULL_HIST_BUCKETS ? 1ULL << i : 1ULL << (i - 1), dev->write_hold_hist[i]);
     }
   }
-  up(&dev->sem);
+  if (dev->tfm != NULL) {
+    seq_printf(m, "  compress %s: hits %lu, misses %lu, compressed %lu quanta, %llu -> %llu bytes\n",
+               scull_compress_alg, dev->nr_hits, dev->nr_misses, dev->nr_compressed,
+               (uint64_t)dev->nr_compressed * dev->quantum, dev->compressed_bytes);
+  }
+  if (dev->spill_filp != NULL) {
+    seq_printf(m, "  spill %s: budget %lu, resident %lu quanta (%llu bytes), spilled %lu quanta\n",
+               scull_spill_file, scull_mem_budget, dev->nr_resident, dev->mem_bytes, dev->nr_spilled);
+  }
+}
+
+static int scull_seq_show(struct seq_file* m, void* v) {
+  struct scull_dev* dev = &scull_dev;
+  struct scull_qset* dptr = v;
+  unsigned i;
+
+  if (v == SEQ_START_TOKEN) {
+    scull_seq_show_header(m, dev);
+    return 0;
+  }
+  seq_printf(m, "  item at %p, qset at %p\n", dptr, dptr->data);
+  // Dump only the least item.
+  if (dptr->data && dptr->next == NULL) {
+    for (i = 0; i < dev->qset; ++i) {
+      seq_printf(m, "    %4u: %8p\n", i, dptr->data[i]);
+    }
+  }
+  return 0;
+}
+
+// /proc/scull_device_summary reads only counters, without dev->sem, so it is
+// cheap to poll. The values may be slightly inconsistent with each other.
+static int scull_summary_show(struct seq_file* m, void* v) {
+  struct scull_dev* dev = &scull_dev;
+  unsigned long nr_resident = READ_ONCE(dev->nr_resident);
+  unsigned long nr_compressed = READ_ONCE(dev->nr_compressed);
+  unsigned long nr_spilled = READ_ONCE(dev->nr_spilled);
+  uint64_t mem_bytes = READ_ONCE(dev->mem_bytes);
+  uint64_t meta_bytes = READ_ONCE(dev->meta_bytes);
+  uint64_t compressed_bytes = READ_ONCE(dev->compressed_bytes);
+
+  seq_printf(m, "size %llu\n", scull_dev_size(dev));
+  seq_printf(m, "quanta %lu\n", nr_resident + nr_spilled);
+  seq_printf(m, "allocated_bytes %llu\n", mem_bytes + meta_bytes);
+  seq_printf(m, "metadata_bytes %llu\n", meta_bytes);
+  // The counters are read one by one, clamp their differences at zero.
+  seq_printf(m, "raw_quanta %lu\n", nr_resident > nr_compressed ? nr_resident - nr_compressed : 0);
+  seq_printf(m, "raw_bytes %llu\n",
+             mem_bytes > compressed_bytes ? mem_bytes - compressed_bytes : 0);
+  seq_printf(m, "compressed_quanta %lu\n", nr_compressed);
+  seq_printf(m, "compressed_bytes %llu\n", compressed_bytes);
+  seq_printf(m, "spilled_quanta %lu\n", nr_spilled);
+  seq_printf(m, "mem_peak_bytes %llu\n", READ_ONCE(dev->mem_peak));
   return 0;
 }
 
+static int scull_summary_open(struct inode* inode, struct file* filp) {
+  return single_open(filp, scull_summary_show, NULL);
+}
+
 module_init(hello_init);
 module_exit(hello_exit);
@@ -1,9 +1,54 @@
 #ifndef SCULL_H_
 #define SCULL_H_
 
+// Per-quantum bookkeeping, owned by the backend that allocates it.
+struct scull_quantum_info;
+
 struct scull_qset {
   void** data;
+  struct scull_quantum_info* info;
   struct scull_qset* next;
 };
 
+struct bio_vec;
+
+// Kernel producer API of the scull device, appending to its log without
+// user copies. Reserve space, fill it with scull_reservation_copy*() and
+// publish it with scull_commit(). Reservations are published in reservation
+// order, so commit soon: later appenders and trims wait for it.
+struct scull_reservation {
+  // Log offset and length of the reservation.
+  uint64_t off;
+  size_t len;
+  // Quanta of the reservation, the data starts at offset first of quanta[0].
+  void** quanta;
+  struct scull_quantum_info** infos;
+  unsigned nr_quanta;
+  unsigned quantum;
+  unsigned first;
+  int err;
+  // Set for reservations from the atomic buffer.
+  void* record;
+  // Inline quanta[0] and infos[0] of reservations within one quantum.
+  void* data;
+  struct scull_quantum_info* info;
+};
+
+// Can sleep. On error there is nothing to commit.
+int scull_reserve(struct scull_reservation* res, size_t len);
+// Doesn't sleep, reserves from the buffer allocated by
+// scull_prealloc_atomic(). Fails with -ENOSPC when it is full, and with
+// -EINVAL if len is 0 or the record can't fit in the buffer at all.
+int scull_reserve_atomic(struct scull_reservation* res, size_t len);
+size_t scull_reservation_copy(struct scull_reservation* res, size_t offset, const void* src,
+                              size_t len);
+size_t scull_reservation_copy_bvec(struct scull_reservation* res, size_t offset,
+                                   const struct bio_vec* bvec, unsigned nr, size_t len);
+// Can sleep for reservations by scull_reserve().
+void scull_commit(struct scull_reservation* res);
+// Can sleep. Allocate the buffer of scull_reserve_atomic(), once.
+int scull_prealloc_atomic(size_t bytes);
+// Can sleep.
+ssize_t scull_kernel_write(const void* buf, size_t count);
+
 #endif  // SCULL_H_
@@ -0,0 +1,367 @@
+#include <linux/atomic.h>
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/bvec.h>
+#include <linux/fs.h>
+#include <linux/genhd.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+// Block device front end of scull storage: quanta of scull_quantum bytes,
+// allocated on first write and freed by discard.
+unsigned scull_blk_major = 0;
+unsigned scull_blk_mb = 256;
+unsigned scull_quantum = PAGE_SIZE;
+unsigned scull_queue_depth = 128;
+
+module_param(scull_blk_major, uint, S_IRUGO);
+module_param(scull_blk_mb, uint, S_IRUGO);
+module_param(scull_quantum, uint, S_IRUGO);
+module_param(scull_queue_depth, uint, S_IRUGO);
+
+#define SCULL_SECTOR_SHIFT  9
+
+struct scull_blk_dev {
+  unsigned quantum;
+  unsigned order;
+  uint64_t size;
+  // One slot per quantum of the device, NULL for holes. Slots are set with
+  // cmpxchg() and cleared with xchg(), and quanta are freed after an RCU
+  // grace period, so the data path takes no lock.
+  void** quanta;
+  uint64_t nr_quanta;
+  atomic64_t nr_allocated;
+  struct blk_mq_tag_set tag_set;
+  struct request_queue* queue;
+  struct gendisk* disk;
+};
+
+struct scull_blk_dev scull_blk_dev;
+
+static blk_status_t scull_queue_rq(struct blk_mq_hw_ctx* hctx, const struct blk_mq_queue_data* bd);
+
+static const struct blk_mq_ops scull_mq_ops = {
+  .queue_rq = scull_queue_rq,
+};
+
+static const struct block_device_operations scull_blk_ops = {
+  .owner = THIS_MODULE,
+};
+
+static void scull_free_quantum_rcu(struct rcu_head* head) {
+  struct page* page = container_of(head, struct page, rcu_head);
+  __free_pages(page, page_private(page));
+}
+
+// Called from a reader or writer under rcu_read_lock(), or when the device
+// is idle.
+static void scull_free_quantum(struct scull_blk_dev* dev, void* q) {
+  struct page* page = virt_to_page(q);
+  set_page_private(page, dev->order);
+  atomic64_dec(&dev->nr_allocated);
+  call_rcu(&page->rcu_head, scull_free_quantum_rcu);
+}
+
+// Return quantum i, allocating it if alloc is set. Called under
+// rcu_read_lock().
+static void* scull_get_quantum(struct scull_blk_dev* dev, uint64_t i, bool alloc) {
+  void* q = READ_ONCE(dev->quanta[i]);
+  void* old;
+
+  if (q != NULL || !alloc) {
+    return q;
+  }
+  // queue_rq() can't sleep, it asks blk-mq to retry the request if this
+  // fails before the request is started.
+  q = (void*)__get_free_pages(GFP_NOWAIT | __GFP_NOWARN | __GFP_ZERO, dev->order);
+  if (q == NULL) {
+    return NULL;
+  }
+  old = cmpxchg(&dev->quanta[i], NULL, q);
+  if (old != NULL) {
+    // Another writer installed it first.
+    free_pages((unsigned long)q, dev->order);
+    return old;
+  }
+  atomic64_inc(&dev->nr_allocated);
+  return q;
+}
+
+// Allocate the missing quanta of [pos, pos + len). Called under
+// rcu_read_lock().
+static bool scull_alloc_range(struct scull_blk_dev* dev, uint64_t pos, uint64_t len) {
+  unsigned shift = PAGE_SHIFT + dev->order;
+  uint64_t i;
+
+  if (len == 0) {
+    return true;
+  }
+  for (i = pos >> shift; i <= (pos + len - 1) >> shift; ++i) {
+    if (scull_get_quantum(dev, i, true) == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copy len bytes between buf and the device at pos.
+static blk_status_t scull_copy(struct scull_blk_dev* dev, char* buf, uint64_t pos, unsigned len,
+                               bool write) {
+  while (len != 0) {
+    uint64_t i = pos >> (PAGE_SHIFT + dev->order);
+    unsigned offset = pos & (dev->quantum - 1);
+    unsigned copy_count = min(len, dev->quantum - offset);
+    void* q = scull_get_quantum(dev, i, write);
+
+    if (write) {
+      if (q == NULL) {
+        return BLK_STS_RESOURCE;
+      }
+      memcpy((char*)q + offset, buf, copy_count);
+    } else if (q != NULL) {
+      memcpy(buf, (char*)q + offset, copy_count);
+    } else {
+      // Holes read as zeros.
+      memset(buf, 0, copy_count);
+    }
+    buf += copy_count;
+    pos += copy_count;
+    len -= copy_count;
+  }
+  return BLK_STS_OK;
+}
+
+// Zero [pos, pos + len). With unmap, whole quanta are freed instead, else
+// they stay allocated.
+static void scull_discard(struct scull_blk_dev* dev, uint64_t pos, uint64_t len, bool unmap) {
+  while (len != 0) {
+    uint64_t i = pos >> (PAGE_SHIFT + dev->order);
+    unsigned offset = pos & (dev->quantum - 1);
+    unsigned count = min_t(uint64_t, len, dev->quantum - offset);
+
+    if (count == dev->quantum && unmap) {
+      void* q = xchg(&dev->quanta[i], NULL);
+      if (q != NULL) {
+        scull_free_quantum(dev, q);
+      }
+    } else {
+      void* q = READ_ONCE(dev->quanta[i]);
+      if (q != NULL) {
+        memset((char*)q + offset, 0, count);
+      }
+    }
+    pos += count;
+    len -= count;
+  }
+}
+
+// Requests are served and completed inline, from the submitting CPU's
+// hardware queue.
+static blk_status_t scull_queue_rq(struct blk_mq_hw_ctx* hctx, const struct blk_mq_queue_data* bd) {
+  struct request* rq = bd->rq;
+  struct scull_blk_dev* dev = hctx->queue->queuedata;
+  uint64_t pos = (uint64_t)blk_rq_pos(rq) << SCULL_SECTOR_SHIFT;
+  blk_status_t status = BLK_STS_OK;
+  bool unmap = !(rq->cmd_flags & REQ_NOUNMAP);
+  struct req_iterator iter;
+  struct bio_vec bvec;
+  bool allocated;
+
+  if (pos + blk_rq_bytes(rq) > dev->size) {
+    return BLK_STS_IOERR;
+  }
+  if (req_op(rq) == REQ_OP_WRITE || (req_op(rq) == REQ_OP_WRITE_ZEROES && !unmap)) {
+    // Allocate before starting the request, blk-mq can only retry requests
+    // which weren't started.
+    rcu_read_lock();
+    allocated = scull_alloc_range(dev, pos, blk_rq_bytes(rq));
+    rcu_read_unlock();
+    if (!allocated) {
+      return BLK_STS_RESOURCE;
+    }
+  }
+  blk_mq_start_request(rq);
+  rcu_read_lock();
+  switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+      rq_for_each_segment(bvec, rq, iter) {
+        char* buf = kmap_atomic(bvec.bv_page);
+        status = scull_copy(dev, buf + bvec.bv_offset, pos, bvec.bv_len, op_is_write(req_op(rq)));
+        kunmap_atomic(buf);
+        if (status != BLK_STS_OK) {
+          break;
+        }
+        pos += bvec.bv_len;
+      }
+      break;
+    case REQ_OP_DISCARD:
+      scull_discard(dev, pos, blk_rq_bytes(rq), true);
+      break;
+    case REQ_OP_WRITE_ZEROES:
+      scull_discard(dev, pos, blk_rq_bytes(rq), unmap);
+      break;
+    case REQ_OP_FLUSH:
+      break;
+    default:
+      status = BLK_STS_NOTSUPP;
+  }
+  rcu_read_unlock();
+  // A write fails with BLK_STS_RESOURCE only if a discard raced with it and
+  // its quanta couldn't be allocated again. The request is started, so it is
+  // ended with that error.
+  blk_mq_end_request(rq, status);
+  return BLK_STS_OK;
+}
+
+static int scull_setup_queue(struct scull_blk_dev* dev) {
+  struct request_queue* q;
+  int err;
+
+  memset(&dev->tag_set, 0, sizeof(dev->tag_set));
+  dev->tag_set.ops = &scull_mq_ops;
+  dev->tag_set.nr_hw_queues = nr_cpu_ids;
+  dev->tag_set.queue_depth = scull_queue_depth;
+  dev->tag_set.numa_node = NUMA_NO_NODE;
+  dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+  err = blk_mq_alloc_tag_set(&dev->tag_set);
+  if (err != 0) {
+    return err;
+  }
+  q = blk_mq_init_queue(&dev->tag_set);
+  if (IS_ERR(q)) {
+    blk_mq_free_tag_set(&dev->tag_set);
+    return PTR_ERR(q);
+  }
+  q->queuedata = dev;
+  blk_queue_logical_block_size(q, 1 << SCULL_SECTOR_SHIFT);
+  blk_queue_physical_block_size(q, PAGE_SIZE);
+  blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+  blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, q);
+  // Discard whole quanta to free them.
+  q->limits.discard_granularity = dev->quantum;
+  q->limits.discard_alignment = 0;
+  blk_queue_max_discard_sectors(q, UINT_MAX >> SCULL_SECTOR_SHIFT);
+  blk_queue_max_write_zeroes_sectors(q, UINT_MAX >> SCULL_SECTOR_SHIFT);
+  blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+  dev->queue = q;
+  return 0;
+}
+
+static void scull_teardown_queue(struct scull_blk_dev* dev) {
+  blk_cleanup_queue(dev->queue);
+  blk_mq_free_tag_set(&dev->tag_set);
+}
+
+static int scull_setup_disk(struct scull_blk_dev* dev) {
+  struct gendisk* disk = alloc_disk(1);
+  if (disk == NULL) {
+    return 1;
+  }
+  disk->major = scull_blk_major;
+  disk->first_minor = 0;
+  disk->fops = &scull_blk_ops;
+  disk->private_data = dev;
+  disk->queue = dev->queue;
+  snprintf(disk->disk_name, DISK_NAME_LEN, "scull_blk0");
+  set_capacity(disk, dev->size >> SCULL_SECTOR_SHIFT);
+  dev->disk = disk;
+  add_disk(disk);
+  return 0;
+}
+
+static void scull_teardown_disk(struct scull_blk_dev* dev) {
+  del_gendisk(dev->disk);
+  put_disk(dev->disk);
+}
+
+static void scull_free_quanta(struct scull_blk_dev* dev) {
+  uint64_t i;
+
+  for (i = 0; i < dev->nr_quanta; ++i) {
+    if (dev->quanta[i] != NULL) {
+      free_pages((unsigned long)dev->quanta[i], dev->order);
+    }
+  }
+  // Wait for quanta freed by discards.
+  rcu_barrier();
+  kvfree(dev->quanta);
+}
+
+static int hello_init(void) {
+  int major;
+
+  pr_alert("Hello, World!\n");
+  pr_alert("In process \"%s\" (pid %d, tgid %d)\n", current->comm, current->pid, current->tgid);
+
+  if (scull_quantum % PAGE_SIZE != 0 || !is_power_of_2(scull_quantum / PAGE_SIZE)) {
+    pr_alert("scull_quantum (%u) is not power_of_2 * PAGE_SIZE(%lu).\n", scull_quantum, PAGE_SIZE);
+    goto error_scull_quantum;
+  }
+
+  major = register_blkdev(scull_blk_major, "scull_blk");
+  if (major < 0) {
+    goto error_register_blkdev;
+  }
+  if (scull_blk_major == 0) {
+    scull_blk_major = major;
+  }
+  pr_alert("register_blkdev major %d\n", scull_blk_major);
+
+  scull_blk_dev.quantum = scull_quantum;
+  scull_blk_dev.order = ilog2(scull_quantum / PAGE_SIZE);
+  scull_blk_dev.size = round_down((uint64_t)scull_blk_mb << 20, scull_quantum);
+  scull_blk_dev.nr_quanta = scull_blk_dev.size / scull_quantum;
+  atomic64_set(&scull_blk_dev.nr_allocated, 0);
+  scull_blk_dev.quanta = kvcalloc(scull_blk_dev.nr_quanta, sizeof(void*), GFP_KERNEL);
+  if (scull_blk_dev.quanta == NULL) {
+    goto error_alloc_quanta;
+  }
+  if (scull_setup_queue(&scull_blk_dev) != 0) {
+    goto error_scull_setup_queue;
+  }
+  if (scull_setup_disk(&scull_blk_dev) != 0) {
+    goto error_scull_setup_disk;
+  }
+
+  pr_alert("scull_blk0: %llu bytes, quantum %u, %u hardware queues\n", scull_blk_dev.size,
+           scull_blk_dev.quantum, nr_cpu_ids);
+
+  return 0;
+error_scull_setup_disk:
+  scull_teardown_queue(&scull_blk_dev);
+error_scull_setup_queue:
+  kvfree(scull_blk_dev.quanta);
+error_alloc_quanta:
+  unregister_blkdev(scull_blk_major, "scull_blk");
+error_register_blkdev:
+error_scull_quantum:
+  return 1;
+}
+
+static void hello_exit(void) {
+  pr_alert("Goodbye, cruel world\n");
+  pr_alert("In process \"%s\" (pid %d, tgid %d)\n", current->comm, current->pid, current->tgid);
+  scull_teardown_disk(&scull_blk_dev);
+  scull_teardown_queue(&scull_blk_dev);
+  pr_alert("scull_blk0: %lld quanta allocated at exit\n",
+           (long long)atomic64_read(&scull_blk_dev.nr_allocated));
+  scull_free_quanta(&scull_blk_dev);
+  unregister_blkdev(scull_blk_major, "scull_blk");
+}
+
+module_init(hello_init);
+module_exit(hello_exit);
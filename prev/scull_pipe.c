@@ -1,60 +1,333 @@
 #include <linux/cdev.h>
+#include <linux/cpumask.h>
+#include <linux/capability.h>
+#include <linux/cred.h>
 #include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/jiffies.h>
 #include <linux/kdev_t.h>
+#include <linux/ioctl.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/pipe_fs_i.h>
 #include <linux/poll.h>
+#include <linux/refcount.h>
 #include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/user.h>
+#include <linux/smp.h>
 #include <linux/semaphore.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/splice.h>
+#include <linux/topology.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/wait.h>
+#include <linux/wait_bit.h>
+#include <asm/barrier.h>
 
 MODULE_LICENSE("Dual BSD/GPL");
 
 #define SCULL_IOC_MAGIC 'z'
 enum {
   SCULL_IOC_NR_FIRST = 0x90,
+  SCULL_IOC_NR_GET_PACKET = SCULL_IOC_NR_FIRST,
+  SCULL_IOC_NR_SET_PACKET,
+  SCULL_IOC_NR_RECV_BATCH,
+  SCULL_IOC_NR_GET_BUFSIZE,
+  SCULL_IOC_NR_SET_BUFSIZE,
+  SCULL_IOC_NR_DOORBELL,
+  SCULL_IOC_NR_SET_RCVLOWAT,
+  SCULL_IOC_NR_SET_SNDLOWAT,
+  SCULL_IOC_NR_SET_RCVTIMEO,
+  SCULL_IOC_NR_GET_STATS,
+  SCULL_IOC_NR_SET_BUSY_POLL,
   SCULL_IOC_NR_LAST,
 };
 
+// One record of SCULL_IOC_RECV_BATCH. len is the size of buf on input, and
+// the record length on output. Records longer than buf are truncated and
+// flagged with SCULL_PIPE_MSG_TRUNC.
+struct scull_pipe_msg {
+  __u64 buf;
+  __u32 len;
+  __u32 flags;
+};
+
+// Argument of SCULL_IOC_RECV_BATCH, nr is set to the number of records
+// dequeued into msgs.
+struct scull_pipe_batch {
+  __u64 msgs;
+  __u32 nr;
+  __u32 reserved;
+};
+
+#define SCULL_PIPE_MSG_TRUNC 1
+
+// Argument of SCULL_IOC_GET_STATS, totals of the device since it was loaded.
+// A read(), a record of SCULL_IOC_RECV_BATCH, a write() or a splice counts as
+// one transfer.
+struct scull_pipe_stats {
+  __u64 bytes_read;
+  __u64 nr_reads;
+  __u64 bytes_written;
+  __u64 nr_writes;
+};
+
+// SCULL_IOC_SET_PACKET switches to packet mode with a non-zero argument, and
+// returns the previous mode. In packet mode each write is one record, written
+// whole or not at all, and each read returns one record.
+#define SCULL_IOC_GET_PACKET  _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_PACKET)
+#define SCULL_IOC_SET_PACKET  _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_PACKET)
+#define SCULL_IOC_RECV_BATCH  _IOWR(SCULL_IOC_MAGIC, SCULL_IOC_NR_RECV_BATCH, struct scull_pipe_batch)
+// Like F_SETPIPE_SZ, SCULL_IOC_SET_BUFSIZE resizes each ring to at least arg
+// bytes, rounded up to a power of two pages, and returns the new size.
+// Buffered data is kept, it fails with EBUSY if the data doesn't fit. The
+// rings are all resized, or none of them.
+#define SCULL_IOC_GET_BUFSIZE _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_BUFSIZE)
+#define SCULL_IOC_SET_BUFSIZE _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_BUFSIZE)
+// Wake up the readers and writers of a mapped ring, after moving its
+// positions from user space.
+#define SCULL_IOC_DOORBELL    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_DOORBELL)
+// Like SO_RCVLOWAT and SO_SNDLOWAT, of this open file. Blocking reads wait
+// for min(arg, count) bytes, and writes that found the ring full wait for arg
+// bytes of room, neither for more than the rings hold. poll reports POLLIN
+// and POLLOUT past them too. They return the previous value, 1 by default.
+#define SCULL_IOC_SET_RCVLOWAT _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_RCVLOWAT)
+#define SCULL_IOC_SET_SNDLOWAT _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_SNDLOWAT)
+// Like SO_RCVTIMEO, in milliseconds, 0 waits forever. A read waiting for
+// SCULL_IOC_SET_RCVLOWAT bytes returns what is there after it, or fails with
+// EAGAIN if there is nothing. Returns the previous value.
+#define SCULL_IOC_SET_RCVTIMEO _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_RCVTIMEO)
+#define SCULL_IOC_GET_STATS    _IOR(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_STATS, struct scull_pipe_stats)
+// Like SO_BUSY_POLL, the max microseconds a blocking read of this open file
+// spins for data before sleeping, 0 to always sleep. The spin adapts below
+// it to how long the reads wait. Raising it above pipe_busy_read needs
+// CAP_NET_ADMIN or CAP_SYS_NICE. Returns the previous value.
+#define SCULL_IOC_SET_BUSY_POLL _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_BUSY_POLL)
+
+// With pipe_mmap, the ring can be mapped shared with a control page at offset
+// 0, followed by its bufsize bytes of data. Positions are free-running, and
+// the ring holds [read_pos, write_pos) at their offsets modulo bufsize. A
+// producer fills the data at write_pos, then stores write_pos with release
+// semantics. A consumer does the same with read_pos after reading. Each side
+// loads the position of the other with acquire semantics. Records of packet
+// mode are a __u32 length and the data, padded to 4 bytes. Reads and writes
+// fail with EIO once the positions are more than bufsize apart, or records
+// are misaligned or overrun write_pos.
+struct scull_pipe_ctrl {
+  __u32 write_pos;
+  __u32 pad0[15];
+  __u32 read_pos;
+  __u32 pad1[15];
+  __u32 bufsize;
+  __u32 flags;
+};
+
+#define SCULL_PIPE_CTRL_PACKET 1
+
+// Records are stored as a u32 length and the data, padded to the header size.
+#define SCULL_PIPE_RECORD_HEADER sizeof(u32)
+// Max records of one SCULL_IOC_RECV_BATCH.
+#define SCULL_PIPE_MAX_BATCH 1024
+// Max ring size, even for CAP_SYS_RESOURCE. Positions are u32, so the size
+// must stay below 2^31.
+#define SCULL_PIPE_MAX_BUFSIZE (1UL << 30)
+// Max of SCULL_IOC_SET_BUSY_POLL, in microseconds.
+#define SCULL_PIPE_MAX_BUSY_POLL USEC_PER_SEC
+// Busy poll of a reader growing from nothing, in nanoseconds.
+#define SCULL_PIPE_BUSY_POLL_START (10 * NSEC_PER_USEC)
+// Max pages of the buffer of a read handed off by a writer.
+#define SCULL_PIPE_HANDOFF_PAGES 16
+
+// Values of pipe_fanout.
+enum {
+  SCULL_PIPE_FANOUT_OFF,
+  // Writers wait for the slowest reader.
+  SCULL_PIPE_FANOUT_WAIT,
+  // Writers never wait, and drop the oldest data even if a reader is behind.
+  // The reader then skips to the oldest data left, and read() fails once
+  // with EOVERFLOW.
+  SCULL_PIPE_FANOUT_OVERWRITE,
+};
+
 unsigned scull_major = 88;
 unsigned long pipe_buffer_size = 4096;
+// Max ring size of SCULL_IOC_SET_BUFSIZE without CAP_SYS_RESOURCE.
+unsigned long pipe_max_size = 16 << 20;
+// Like pipe_user_pages_soft, the pages a user may have in pipe buffers past
+// which SCULL_IOC_SET_BUFSIZE can't grow the rings without
+// CAP_SYS_RESOURCE, 0 for no limit. The pages of the rings are counted with
+// the pipe buffers of the user that opened the device first.
+unsigned long pipe_user_pages = 16384;
+// Give each CPU its own ring of pipe_buffer_size bytes. Writers fill the ring
+// of the CPU they run on, and the reader drains the rings round-robin, so
+// only writes to the same ring are kept in order.
+bool pipe_percpu = false;
+// Let the ring be mapped, see struct scull_pipe_ctrl. Its pages then stay in
+// place: splice copies, and the ring can't be resized. Not with pipe_percpu.
+bool pipe_mmap = false;
+// Give each reader its own cursor, so all of them read all the data, see
+// SCULL_PIPE_FANOUT_WAIT and SCULL_PIPE_FANOUT_OVERWRITE. A reader starts at
+// the oldest data in the ring. Byte stream only, and not with pipe_percpu
+// or pipe_mmap.
+unsigned pipe_fanout = SCULL_PIPE_FANOUT_OFF;
+// Like net.core.busy_read, SCULL_IOC_SET_BUSY_POLL of newly opened files.
+unsigned pipe_busy_read = 0;
 
 module_param(scull_major, uint, S_IRUGO);
 module_param(pipe_buffer_size, ulong, S_IRUGO);
+module_param(pipe_max_size, ulong, S_IRUGO);
+module_param(pipe_user_pages, ulong, S_IRUGO);
+module_param(pipe_percpu, bool, S_IRUGO);
+module_param(pipe_mmap, bool, S_IRUGO);
+module_param(pipe_fanout, uint, S_IRUGO);
+module_param(pipe_busy_read, uint, S_IRUGO);
 
 const unsigned scull_minor_start = 16;
 
+// Pipes at minors from scull_minor_start, each with its own rings and locks.
 unsigned scull_nr_devs = 1;
 
+module_param(scull_nr_devs, uint, S_IRUGO);
+
+// A lock-free single-producer/single-consumer ring. Writers of the ring are
+// serialized by write_lock, and readers by the read_lock of the device. Both
+// are held to resize it, and neither is held while sleeping.
+struct scull_pipe_ring {
+  // bufsize / PAGE_SIZE pages, allocated on node. Splice swaps whole pages
+  // of data in and out of the ring, which only touches the slots its side
+  // owns.
+  struct page** pages;
+  // Power of two pages, all of it is usable.
+  uint64_t bufsize;
+  int node;
+  // Positions of the ring, in ctrl_page that can be mapped with the data.
+  struct scull_pipe_ctrl* ctrl;
+  struct page* ctrl_page;
+  struct mutex write_lock ____cacheline_aligned_in_smp;
+  // Statistics of the writers, under write_lock. Handoffs also count as
+  // reads.
+  uint64_t bytes_written, nr_writes;
+  uint64_t bytes_handed_off, nr_handoffs;
+};
+
+// A reader parked in scull_pipe_read() with the pages of its buffer pinned.
+// A writer finding it with its own ring empty takes it from the device,
+// copies straight into the pages and completes the read. The data isn't
+// copied through the ring, and the reader doesn't have to lock anything once
+// woken up. The reader and the writer that took it each hold a reference,
+// so a killed reader can leave while the writer still copies. The last one
+// puts the pages.
+struct scull_pipe_handoff {
+  refcount_t refs;
+  struct page* pages[SCULL_PIPE_HANDOFF_PAGES];
+  unsigned nr_pages;
+  // Of the buffer in pages[0].
+  unsigned offset;
+  size_t count;
+  // Set by the writer before completed.
+  size_t copied;
+  bool completed;
+};
+
+// sem only protects the reader and writer counts, so one reader and one
+// writer never share a lock.
 struct scull_pipe_dev {
   struct semaphore sem;
-  char* buffer;
-  uint64_t bufsize;
-  char* read_head;
-  char* write_head;
+  // One ring, or one per possible CPU with pipe_percpu.
+  struct scull_pipe_ring* rings;
+  unsigned nr_rings;
+  // Whether the rings have their pages, under sem.
+  bool allocated;
+  // The user their pages are charged to, and how many, under sem.
+  struct user_struct* user;
+  unsigned long user_pages;
   wait_queue_head_t reader_wq, writer_wq;
   unsigned nr_reader, nr_writer;
   struct cdev cdev;
+  // Packet mode, see SCULL_IOC_SET_PACKET.
+  bool packet;
+  // The parked reader, if any.
+  spinlock_t handoff_lock;
+  struct scull_pipe_handoff* handoff;
+  struct mutex read_lock ____cacheline_aligned_in_smp;
+  // Next ring to read from, under read_lock.
+  unsigned read_ring;
+  // Readers of pipe_fanout, under read_lock. The read_pos of the ring is the
+  // slowest of them with SCULL_PIPE_FANOUT_WAIT.
+  struct list_head readers;
+  // Statistics of the readers, under read_lock.
+  uint64_t bytes_read, nr_reads;
 };
 
-struct scull_pipe_dev scull_pipe_dev;
+// State of one open file, in its private_data.
+struct scull_pipe_file {
+  struct scull_pipe_dev* dev;
+  // See SCULL_IOC_SET_RCVLOWAT and SCULL_IOC_SET_SNDLOWAT, at least 1.
+  u32 rcvlowat, sndlowat;
+  // In jiffies, MAX_SCHEDULE_TIMEOUT for none.
+  long rcvtimeo;
+  // See SCULL_IOC_SET_BUSY_POLL, in microseconds. busy_poll_ns is how long
+  // reads spin now, updated without a lock as it is only a hint.
+  unsigned busy_poll;
+  u64 busy_poll_ns;
+  // Cursor of a reader of pipe_fanout in dev->readers, under read_lock.
+  u32 read_pos;
+  struct list_head node;
+};
+
+// A reader or writer sleeping until it can move lowat bytes. Its wake
+// function checks that, so small transfers of the other side don't wake it
+// up for nothing.
+struct scull_pipe_waiter {
+  struct wait_queue_entry wait;
+  struct scull_pipe_dev* dev;
+  // The ring of a writer, NULL for a reader.
+  struct scull_pipe_ring* ring;
+  // The file of a reader, and its handoff if parked.
+  struct scull_pipe_file* pf;
+  struct scull_pipe_handoff* handoff;
+  uint64_t lowat;
+};
+
+struct scull_pipe_dev* scull_pipe_devs;
+// Control of the rings of CPUs that aren't possible, always empty.
+static struct scull_pipe_ctrl scull_pipe_empty_ctrl;
 unsigned scull_minor = 16;
 
 static int scull_pipe_setup_dev(struct scull_pipe_dev* dev, dev_t devno);
 static void scull_pipe_teardown_dev(struct scull_pipe_dev* dev);
 static int scull_pipe_setup_cdev(struct scull_pipe_dev* dev, dev_t devno);
 static void scull_pipe_teardown_cdev(struct scull_pipe_dev* dev);
+static int scull_pipe_setup_rings(struct scull_pipe_dev* dev);
+static void scull_pipe_free_rings(struct scull_pipe_dev* dev);
+static struct page** scull_pipe_alloc_pages(unsigned nr_pages, int node);
+static void scull_pipe_free_pages(struct page** pages, unsigned nr_pages);
 
 static int scull_pipe_open(struct inode* inode, struct file* filp);
 static int scull_pipe_release(struct inode* inode, struct file* filp);
+static void scull_pipe_subscribe(struct scull_pipe_file* pf);
+static void scull_pipe_unsubscribe(struct scull_pipe_file* pf);
 static ssize_t scull_pipe_read(struct file* filp, char __user* buf, size_t count, loff_t* f_pos);
 static ssize_t scull_pipe_write(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos);
 static unsigned int scull_pipe_poll(struct file* filp, struct poll_table_struct* poll_table);
+static long scull_pipe_ioctl(struct file* filp, unsigned int cmd, unsigned long arg);
+static int scull_pipe_mmap(struct file* filp, struct vm_area_struct* vma);
+static ssize_t scull_pipe_splice_read(struct file* filp, loff_t* ppos, struct pipe_inode_info* pipe,
+                                      size_t len, unsigned int flags);
+static ssize_t scull_pipe_splice_write(struct pipe_inode_info* pipe, struct file* filp, loff_t* ppos,
+                                       size_t len, unsigned int flags);
 
 static int is_buffer_empty_and_has_no_writer(struct scull_pipe_dev* dev);
 
@@ -65,10 +338,28 @@ static struct file_operations scull_pipe_ops = {
   .read = scull_pipe_read,
   .write = scull_pipe_write,
   .poll = scull_pipe_poll,
+  .unlocked_ioctl = scull_pipe_ioctl,
+  .mmap = scull_pipe_mmap,
+  .splice_read = scull_pipe_splice_read,
+  .splice_write = scull_pipe_splice_write,
+};
+
+// Pages spliced out of a ring are owned by the pipe, and can be stolen by
+// the consumer.
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+  .confirm = generic_pipe_buf_confirm,
+  .release = generic_pipe_buf_release,
+  .steal = generic_pipe_buf_steal,
+  .get = generic_pipe_buf_get,
 };
 
 static int scull_pipe_init(void) {
+  unsigned i;
+
   pr_alert("scull_pipe_init\n");
+  if (scull_nr_devs == 0) {
+    goto error_register_dev_t;
+  }
   if (scull_major != 0) {
     if (register_chrdev_region(MKDEV(scull_major, scull_minor_start), scull_nr_devs, "scull_pipe_device") != 0) {
       goto error_register_dev_t;
@@ -82,54 +373,192 @@ static int scull_pipe_init(void) {
   }
   pr_alert("register/alloc chrdev_region major %d, minor %d-%d\n", scull_major, scull_minor_start, scull_minor_start + scull_nr_devs - 1);
 
-  if (scull_pipe_setup_dev(&scull_pipe_dev, MKDEV(scull_major, scull_minor_start))) {
-    goto error_scull_pipe_setup_dev;
+  scull_pipe_devs = kcalloc(scull_nr_devs, sizeof(struct scull_pipe_dev), GFP_KERNEL);
+  if (scull_pipe_devs == NULL) {
+    goto error_alloc_devs;
+  }
+  for (i = 0; i < scull_nr_devs; ++i) {
+    if (scull_pipe_setup_dev(&scull_pipe_devs[i], MKDEV(scull_major, scull_minor_start + i))) {
+      goto error_scull_pipe_setup_dev;
+    }
   }
 
   return 0;
 
 error_scull_pipe_setup_dev:
+  while (i-- > 0) {
+    scull_pipe_teardown_dev(&scull_pipe_devs[i]);
+  }
+  kfree(scull_pipe_devs);
+error_alloc_devs:
   unregister_chrdev_region(MKDEV(scull_major, scull_minor_start), scull_nr_devs);
 error_register_dev_t:
   return 1;
 }
 
 static void scull_pipe_exit(void) {
+  unsigned i;
+
   pr_alert("scull_pipe_exit\n");
-  scull_pipe_teardown_dev(&scull_pipe_dev);
+  for (i = 0; i < scull_nr_devs; ++i) {
+    scull_pipe_teardown_dev(&scull_pipe_devs[i]);
+  }
+  kfree(scull_pipe_devs);
   unregister_chrdev_region(MKDEV(scull_major, scull_minor_start), scull_nr_devs);
 }
 
+// The rings get their pages on the first open, see scull_pipe_setup_rings().
 static int scull_pipe_setup_dev(struct scull_pipe_dev* dev, dev_t devno) {
   int retval = 0;
+  unsigned i;
 
+  if (pipe_fanout > SCULL_PIPE_FANOUT_OVERWRITE ||
+      (pipe_fanout != SCULL_PIPE_FANOUT_OFF && (pipe_percpu || pipe_mmap))) {
+    pr_alert("pipe_fanout %u not supported\n", pipe_fanout);
+    return -EINVAL;
+  }
+
+  if (pipe_buffer_size < PAGE_SIZE || pipe_buffer_size > SCULL_PIPE_MAX_BUFSIZE ||
+      !is_power_of_2(pipe_buffer_size)) {
+    pipe_buffer_size = roundup_pow_of_two(clamp(pipe_buffer_size, PAGE_SIZE, SCULL_PIPE_MAX_BUFSIZE));
+    pr_alert("pipe_buffer_size rounded to %lu\n", pipe_buffer_size);
+  }
   sema_init(&dev->sem, 1);
-  dev->buffer = kmalloc(pipe_buffer_size, GFP_KERNEL);
-  if (dev->buffer == NULL) {
-    retval = -ENOMEM;
-    dev->bufsize = 0;
-  } else {
-    dev->bufsize = pipe_buffer_size;
+  mutex_init(&dev->read_lock);
+  dev->read_ring = 0;
+  dev->packet = false;
+  dev->allocated = false;
+  dev->user = NULL;
+  dev->user_pages = 0;
+  spin_lock_init(&dev->handoff_lock);
+  dev->handoff = NULL;
+  INIT_LIST_HEAD(&dev->readers);
+  dev->nr_rings = pipe_percpu ? nr_cpu_ids : 1;
+  dev->rings = kcalloc(dev->nr_rings, sizeof(struct scull_pipe_ring), GFP_KERNEL);
+  if (dev->rings == NULL) {
+    return -ENOMEM;
+  }
+  for (i = 0; i < dev->nr_rings; ++i) {
+    dev->rings[i].ctrl = &scull_pipe_empty_ctrl;
+    mutex_init(&dev->rings[i].write_lock);
   }
-  dev->read_head = dev->buffer;
-  dev->write_head = dev->buffer;
   dev->nr_reader = 0;
   dev->nr_writer = 0;
   init_waitqueue_head(&dev->reader_wq);
   init_waitqueue_head(&dev->writer_wq);
 
-  if (retval == 0) {
-    retval = scull_pipe_setup_cdev(dev, devno);
+  retval = scull_pipe_setup_cdev(dev, devno);
+  if (retval != 0) {
+    kfree(dev->rings);
   }
   return retval;
 }
 
 static void scull_pipe_teardown_dev(struct scull_pipe_dev* dev) {
   scull_pipe_teardown_cdev(dev);
-  kfree(dev->buffer);
-  dev->buffer = NULL;
-  dev->read_head = dev->write_head = NULL;
-  dev->bufsize = 0;
+  scull_pipe_free_rings(dev);
+  kfree(dev->rings);
+}
+
+static struct page** scull_pipe_alloc_pages(unsigned nr_pages, int node) {
+  struct page** pages = kvzalloc_node(nr_pages * sizeof(struct page*), GFP_KERNEL_ACCOUNT, node);
+  unsigned i;
+
+  if (pages == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < nr_pages; ++i) {
+    pages[i] = alloc_pages_node(node, GFP_KERNEL_ACCOUNT, 0);
+    if (pages[i] == NULL) {
+      scull_pipe_free_pages(pages, i);
+      return NULL;
+    }
+  }
+  return pages;
+}
+
+static void scull_pipe_free_pages(struct page** pages, unsigned nr_pages) {
+  unsigned i;
+
+  if (pages == NULL) {
+    return;
+  }
+  // Pages gifted by splice may be user pages, they are put rather than freed.
+  for (i = 0; i < nr_pages; ++i) {
+    put_page(pages[i]);
+  }
+  kvfree(pages);
+}
+
+// Charge nr_pages of ring pages in all to dev->user, in place of what was
+// charged before, like account_pipe_buffers(). Return the pages the user now
+// has. Called with dev->sem held.
+static unsigned long scull_pipe_account(struct scull_pipe_dev* dev, unsigned long nr_pages) {
+  unsigned long user_pages =
+      atomic_long_add_return((long)nr_pages - (long)dev->user_pages, &dev->user->pipe_bufs);
+
+  dev->user_pages = nr_pages;
+  return user_pages;
+}
+
+// Allocate the rings of dev, on the first open. A single ring is allocated
+// on the node of the opening CPU, per-CPU rings on the node of their CPU.
+// Rings of CPUs that aren't possible have no pages, and a control page that
+// stays empty. The pages are charged to the opening user. Called with
+// dev->sem held.
+static int scull_pipe_setup_rings(struct scull_pipe_dev* dev) {
+  unsigned long nr_pages = 0;
+  unsigned i;
+
+  for (i = 0; i < dev->nr_rings; ++i) {
+    struct scull_pipe_ring* ring = &dev->rings[i];
+    int node = numa_node_id();
+
+    if (pipe_percpu) {
+      if (!cpu_possible(i)) {
+        continue;
+      }
+      node = cpu_to_node(i);
+    }
+    ring->node = node;
+    ring->ctrl_page = alloc_pages_node(node, GFP_KERNEL_ACCOUNT | __GFP_ZERO, 0);
+    if (ring->ctrl_page == NULL) {
+      return -ENOMEM;
+    }
+    ring->ctrl = page_address(ring->ctrl_page);
+    ring->pages = scull_pipe_alloc_pages(pipe_buffer_size >> PAGE_SHIFT, node);
+    if (ring->pages == NULL) {
+      return -ENOMEM;
+    }
+    ring->bufsize = pipe_buffer_size;
+    ring->ctrl->bufsize = pipe_buffer_size;
+    nr_pages += pipe_buffer_size >> PAGE_SHIFT;
+  }
+  dev->user = get_current_user();
+  scull_pipe_account(dev, nr_pages);
+  return 0;
+}
+
+static void scull_pipe_free_rings(struct scull_pipe_dev* dev) {
+  unsigned i;
+
+  for (i = 0; i < dev->nr_rings; ++i) {
+    struct scull_pipe_ring* ring = &dev->rings[i];
+
+    scull_pipe_free_pages(ring->pages, ring->bufsize >> PAGE_SHIFT);
+    if (ring->ctrl_page != NULL) {
+      __free_page(ring->ctrl_page);
+    }
+    ring->pages = NULL;
+    ring->bufsize = 0;
+    ring->ctrl_page = NULL;
+    ring->ctrl = &scull_pipe_empty_ctrl;
+  }
+  if (dev->user != NULL) {
+    scull_pipe_account(dev, 0);
+    free_uid(dev->user);
+    dev->user = NULL;
+  }
 }
 
 static int scull_pipe_setup_cdev(struct scull_pipe_dev* dev, dev_t devno) {
@@ -152,14 +581,40 @@ static void scull_pipe_teardown_cdev(struct scull_pipe_dev* dev) {
 
 static int scull_pipe_open(struct inode* inode, struct file* filp) {
   struct scull_pipe_dev* dev;
+  struct scull_pipe_file* pf;
   int retval = 0;
   pr_alert("scull_pipe_open\n");
   dev = container_of(inode->i_cdev, struct scull_pipe_dev, cdev);
-  filp->private_data = dev;
+  // Check the mode before the rings are allocated and charged. A shared
+  // mapping needs a read-write file, it counts as both sides like a FIFO
+  // opened read-write.
+  if ((filp->f_flags & O_ACCMODE) != O_RDONLY && (filp->f_flags & O_ACCMODE) != O_WRONLY &&
+      !((filp->f_flags & O_ACCMODE) == O_RDWR && pipe_mmap)) {
+    return -EINVAL;
+  }
+  pf = kmalloc(sizeof(struct scull_pipe_file), GFP_KERNEL);
+  if (pf == NULL) {
+    return -ENOMEM;
+  }
+  pf->dev = dev;
+  pf->rcvlowat = 1;
+  pf->sndlowat = 1;
+  pf->rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+  pf->busy_poll = min_t(unsigned, pipe_busy_read, SCULL_PIPE_MAX_BUSY_POLL);
+  pf->busy_poll_ns = min_t(u64, SCULL_PIPE_BUSY_POLL_START, pf->busy_poll * NSEC_PER_USEC);
+  filp->private_data = pf;
   if (down_interruptible(&dev->sem)) {
     retval = -ERESTARTSYS;
     goto out;
   }
+  if (!dev->allocated) {
+    retval = scull_pipe_setup_rings(dev);
+    if (retval != 0) {
+      scull_pipe_free_rings(dev);
+      goto out_with_lock;
+    }
+    dev->allocated = true;
+  }
 
   if ((filp->f_flags & O_ACCMODE) == O_RDONLY) {
     dev->nr_reader++;
@@ -175,24 +630,37 @@ static int scull_pipe_open(struct inode* inode, struct file* filp) {
         goto out;
       }
     }
+    if (pipe_fanout != SCULL_PIPE_FANOUT_OFF) {
+      scull_pipe_subscribe(pf);
+    }
   } else if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
     dev->nr_writer++;
+    wake_up_interruptible(&dev->reader_wq);
   } else {
-    retval = -EINVAL;
-    goto out_with_lock;
+    // O_RDWR with pipe_mmap.
+    dev->nr_reader++;
+    dev->nr_writer++;
+    wake_up_interruptible(&dev->reader_wq);
   }
 
 out_with_lock:
   up(&dev->sem);
 out:
+  if (retval != 0) {
+    kfree(pf);
+  }
   return retval;
 }
 
 static int scull_pipe_release(struct inode* inode, struct file* filp) {
-  struct scull_pipe_dev* dev = filp->private_data;
+  struct scull_pipe_file* pf = filp->private_data;
+  struct scull_pipe_dev* dev = pf->dev;
   int retval = 0;
   pr_alert("scull_pipe_release\n");
 
+  if (pipe_fanout != SCULL_PIPE_FANOUT_OFF && (filp->f_flags & O_ACCMODE) == O_RDONLY) {
+    scull_pipe_unsubscribe(pf);
+  }
   if (down_interruptible(&dev->sem)) {
     retval = -ERESTARTSYS;
     goto out;
@@ -200,197 +668,1311 @@ static int scull_pipe_release(struct inode* inode, struct file* filp) {
 
   if ((filp->f_flags & O_ACCMODE) == O_RDONLY) {
     dev->nr_reader--;
-  } else if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-    dev->nr_writer--;
+  } else {
+    if ((filp->f_flags & O_ACCMODE) == O_RDWR) {
+      dev->nr_reader--;
+    }
+    // Readers waiting for data see the end of file, all of them.
+    if (--dev->nr_writer == 0) {
+      wake_up_interruptible_all(&dev->reader_wq);
+    }
   }
 
   up(&dev->sem);
 out:
+  kfree(pf);
   return retval;
 }
 
-static int is_buffer_empty(struct scull_pipe_dev* dev) {
-  return dev->read_head == dev->write_head;
+// Bytes readable from read_pos, for the reader or poll. Positions further
+// apart than the ring read as a full ring, for the reader to fail on.
+static uint64_t scull_pipe_available(struct scull_pipe_ring* ring, u32 read_pos) {
+  return min_t(uint64_t, smp_load_acquire(&ring->ctrl->write_pos) - read_pos, READ_ONCE(ring->bufsize));
+}
+
+// Bytes writable at write_pos, for the writer or poll. None if the positions
+// are further apart than the ring.
+static uint64_t scull_pipe_space(struct scull_pipe_ring* ring, u32 write_pos) {
+  uint64_t bufsize = READ_ONCE(ring->bufsize);
+  u32 used = write_pos - smp_load_acquire(&ring->ctrl->read_pos);
+
+  return used > bufsize ? 0 : bufsize - used;
+}
+
+// Bytes between the positions of the ring, each loaded once by the caller.
+// With pipe_mmap they are in a page any mapper can write, so they are checked
+// before the data is touched: -EIO if they are further apart than the ring,
+// or in packet mode not aligned to the record header.
+static int64_t scull_pipe_window(struct scull_pipe_ring* ring, u32 read_pos, u32 write_pos, bool packet) {
+  if (write_pos - read_pos > ring->bufsize ||
+      (packet && (read_pos | write_pos) % SCULL_PIPE_RECORD_HEADER != 0)) {
+    return -EIO;
+  }
+  return write_pos - read_pos;
+}
+
+// The byte at ring position pos, up to the end of its page.
+static char* scull_pipe_ptr(struct page** pages, uint64_t bufsize, u32 pos) {
+  return (char*)page_address(pages[(pos & (bufsize - 1)) >> PAGE_SHIFT]) + offset_in_page(pos);
+}
+
+// Bytes of a record of len bytes in the ring.
+static uint64_t scull_pipe_record_size(size_t len) {
+  return SCULL_PIPE_RECORD_HEADER + ALIGN(len, SCULL_PIPE_RECORD_HEADER);
+}
+
+// The ring written to from this CPU.
+static struct scull_pipe_ring* scull_pipe_writer_ring(struct scull_pipe_dev* dev) {
+  return dev->nr_rings == 1 ? &dev->rings[0] : &dev->rings[raw_smp_processor_id()];
 }
 
-static int is_buffer_empty_and_has_writer(struct scull_pipe_dev* dev) {
-  return dev->nr_writer != 0 && is_buffer_empty(dev);
+static int is_ring_empty(struct scull_pipe_ring* ring) {
+  return scull_pipe_available(ring, READ_ONCE(ring->ctrl->read_pos)) == 0;
+}
+
+static int is_buffer_empty(struct scull_pipe_dev* dev) {
+  unsigned i;
+
+  for (i = 0; i < dev->nr_rings; ++i) {
+    if (!is_ring_empty(&dev->rings[i])) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
 static int is_buffer_empty_and_has_no_writer(struct scull_pipe_dev* dev) {
-  return dev->nr_writer == 0 && is_buffer_empty(dev);
+  return READ_ONCE(dev->nr_writer) == 0 && is_buffer_empty(dev);
 }
 
-static ssize_t scull_pipe_read(struct file* filp, char __user* buf, size_t count, loff_t* f_pos) {
-  struct scull_pipe_dev* dev = filp->private_data;
-  ssize_t retval = 0;
-  uint64_t available_count;
-  size_t last_count, read_count;
+// Bytes all the rings can hold, readers never wait for more.
+static uint64_t scull_pipe_capacity(struct scull_pipe_dev* dev) {
+  uint64_t capacity = 0;
+  unsigned i;
+
+  for (i = 0; i < dev->nr_rings; ++i) {
+    capacity += READ_ONCE(dev->rings[i].bufsize);
+  }
+  return capacity;
+}
 
-  pr_alert("scull_pipe_read\n");
+// Bytes readable from all the rings, records with their header.
+static uint64_t scull_pipe_buffer_available(struct scull_pipe_dev* dev) {
+  uint64_t available = 0;
+  unsigned i;
 
-  if (down_interruptible(&dev->sem)) {
-    retval = -ERESTARTSYS;
-    goto out;
+  for (i = 0; i < dev->nr_rings; ++i) {
+    available += scull_pipe_available(&dev->rings[i], READ_ONCE(dev->rings[i].ctrl->read_pos));
   }
+  return available;
+}
 
-  while (is_buffer_empty_and_has_writer(dev)) {
-    up(&dev->sem);
-    if (filp->f_flags & O_NONBLOCK) {
-      retval =  -EAGAIN;
-      goto out;
+// Bytes readable by pf, from its own cursor with pipe_fanout.
+static uint64_t scull_pipe_reader_available(struct scull_pipe_file* pf) {
+  if (pipe_fanout != SCULL_PIPE_FANOUT_OFF) {
+    return scull_pipe_available(&pf->dev->rings[0], READ_ONCE(pf->read_pos));
+  }
+  return scull_pipe_buffer_available(pf->dev);
+}
+
+// Wake up the other side. The barrier in wq_has_sleeper() pairs with the one
+// in scull_pipe_wait(), so a waiter either sees the new position or is seen
+// here. The key tells epoll which side this is, so an exclusive epoll entry
+// of the other side doesn't take the wakeup.
+static void scull_pipe_wake_up(wait_queue_head_t* wq, __poll_t key) {
+  if (wq_has_sleeper(wq)) {
+    wake_up_interruptible_poll(wq, key);
+  }
+}
+
+static void scull_pipe_wake_readers(struct scull_pipe_dev* dev) {
+  scull_pipe_wake_up(&dev->reader_wq, EPOLLIN | EPOLLRDNORM);
+}
+
+static void scull_pipe_wake_writers(struct scull_pipe_dev* dev) {
+  scull_pipe_wake_up(&dev->writer_wq, EPOLLOUT | EPOLLWRNORM);
+}
+
+// Readers wait exclusively, and each wakeup wakes one that can make
+// progress. One leaving data behind, or giving up, hands it on to the next.
+// Readers of pipe_fanout all get the data, so they are all woken up.
+static void scull_pipe_read_unlock(struct scull_pipe_dev* dev) {
+  mutex_unlock(&dev->read_lock);
+  if (pipe_fanout == SCULL_PIPE_FANOUT_OFF && !is_buffer_empty(dev)) {
+    scull_pipe_wake_readers(dev);
+  }
+}
+
+static bool scull_pipe_waiter_ready(struct scull_pipe_waiter* waiter) {
+  struct scull_pipe_ring* ring = waiter->ring;
+
+  if (ring == NULL) {
+    if (waiter->handoff != NULL && smp_load_acquire(&waiter->handoff->completed)) {
+      return true;
     }
-    retval = wait_event_interruptible(dev->reader_wq, !is_buffer_empty_and_has_writer(dev));
-    if (retval != 0) {
-      retval = -ERESTARTSYS;
-      goto out;
+    // Resizing can also shrink the rings below lowat.
+    return READ_ONCE(waiter->dev->nr_writer) == 0 ||
+           scull_pipe_reader_available(waiter->pf) >=
+           min(waiter->lowat, scull_pipe_capacity(waiter->dev));
+  }
+  // Resizing can also make a record fit, or never fit. Positions moved out
+  // of the ring by a mapping fail the write.
+  return scull_pipe_space(ring, READ_ONCE(ring->ctrl->write_pos)) >= waiter->lowat ||
+         waiter->lowat > READ_ONCE(ring->bufsize) ||
+         scull_pipe_window(ring, smp_load_acquire(&ring->ctrl->read_pos),
+                           READ_ONCE(ring->ctrl->write_pos), false) < 0;
+}
+
+static int scull_pipe_wake_function(struct wait_queue_entry* wait, unsigned mode, int sync, void* key) {
+  if (!scull_pipe_waiter_ready(container_of(wait, struct scull_pipe_waiter, wait))) {
+    return 0;
+  }
+  return woken_wake_function(wait, mode, sync, key);
+}
+
+// Sleep on wq until waiter is ready, for up to timeout jiffies. Return the
+// jiffies left, or -ERESTARTSYS on a signal. Readers serialize on read_lock
+// anyway, so they wait exclusively.
+static long scull_pipe_wait(wait_queue_head_t* wq, struct scull_pipe_waiter* waiter, long timeout) {
+  init_waitqueue_func_entry(&waiter->wait, scull_pipe_wake_function);
+  waiter->wait.private = current;
+  if (waiter->ring == NULL && pipe_fanout == SCULL_PIPE_FANOUT_OFF) {
+    add_wait_queue_exclusive(wq, &waiter->wait);
+  } else {
+    add_wait_queue(wq, &waiter->wait);
+  }
+  // Pairs with the barrier in wq_has_sleeper().
+  smp_mb();
+  while (!scull_pipe_waiter_ready(waiter) && timeout != 0) {
+    if (signal_pending(current)) {
+      timeout = -ERESTARTSYS;
+      break;
     }
-    if (down_interruptible(&dev->sem)) {
-      retval = -ERESTARTSYS;
-      goto out;
+    timeout = wait_woken(&waiter->wait, TASK_INTERRUPTIBLE, timeout);
+  }
+  remove_wait_queue(wq, &waiter->wait);
+  return timeout;
+}
+
+// Like halt polling of KVM. A wait shorter than the max busy poll would have
+// been caught by spinning longer, so the spin grows. A longer one only
+// wasted the spin, so it shrinks, down to nothing.
+static void scull_pipe_adapt_busy_poll(struct scull_pipe_file* pf, u64 wait_ns) {
+  u64 max_ns = (u64)READ_ONCE(pf->busy_poll) * NSEC_PER_USEC;
+  u64 busy_poll_ns = READ_ONCE(pf->busy_poll_ns);
+
+  if (wait_ns > max_ns) {
+    busy_poll_ns /= 2;
+    if (busy_poll_ns < SCULL_PIPE_BUSY_POLL_START) {
+      busy_poll_ns = 0;
     }
+  } else if (busy_poll_ns < max_ns) {
+    busy_poll_ns = busy_poll_ns == 0 ? SCULL_PIPE_BUSY_POLL_START : busy_poll_ns * 2;
   }
-  if (dev->read_head <= dev->write_head) {
-    available_count = dev->write_head - dev->read_head;
-  } else {
-    available_count = dev->write_head + dev->bufsize - dev->read_head;
+  WRITE_ONCE(pf->busy_poll_ns, min(busy_poll_ns, max_ns));
+}
+
+// Wait like scull_pipe_wait() as a reader of pf, spinning for its busy poll
+// first. The spin stops early for a signal or another task to run. Waits
+// that end in the spin adapt it too, so a reader whose spins all hit keeps
+// spinning.
+static long scull_pipe_wait_reader(struct scull_pipe_file* pf, struct scull_pipe_waiter* waiter,
+                                   long timeout) {
+  u64 busy_poll_ns = READ_ONCE(pf->busy_poll_ns);
+  u64 start;
+
+  if (READ_ONCE(pf->busy_poll) == 0) {
+    return scull_pipe_wait(&pf->dev->reader_wq, waiter, timeout);
+  }
+  start = local_clock();
+  while (local_clock() - start < busy_poll_ns) {
+    if (scull_pipe_waiter_ready(waiter)) {
+      scull_pipe_adapt_busy_poll(pf, local_clock() - start);
+      return timeout;
+    }
+    if (signal_pending(current) || need_resched()) {
+      break;
+    }
+    cpu_relax();
+  }
+  timeout = scull_pipe_wait(&pf->dev->reader_wq, waiter, timeout);
+  if (timeout > 0) {
+    scull_pipe_adapt_busy_poll(pf, local_clock() - start);
+  }
+  return timeout;
+}
+
+// Copy count bytes at ring position pos to buf, a page at a time.
+static int scull_pipe_copy_out(struct scull_pipe_ring* ring, u32 pos, char __user* buf,
+                               size_t count) {
+  while (count != 0) {
+    size_t read_count = min_t(size_t, count, PAGE_SIZE - offset_in_page(pos));
+    if (copy_to_user(buf, scull_pipe_ptr(ring->pages, ring->bufsize, pos), read_count)) {
+      return -EFAULT;
+    }
+    buf += read_count;
+    pos += read_count;
+    count -= read_count;
+  }
+  return 0;
+}
+
+// Copy count bytes from buf to ring position pos, a page at a time.
+static int scull_pipe_copy_in(struct scull_pipe_ring* ring, u32 pos,
+                              const char __user* buf, size_t count) {
+  while (count != 0) {
+    size_t write_count = min_t(size_t, count, PAGE_SIZE - offset_in_page(pos));
+    if (copy_from_user(scull_pipe_ptr(ring->pages, ring->bufsize, pos), buf, write_count)) {
+      return -EFAULT;
+    }
+    buf += write_count;
+    pos += write_count;
+    count -= write_count;
+  }
+  return 0;
+}
+
+// Lock dev->read_lock and wait until the buffer has min(rcvlowat, count)
+// bytes, or is full, or has no writer. Once rcvtimeo passed, or with
+// nonblock, any data will do. The lock is dropped while waiting. Return 1 if
+// there is data, and 0 at end of file, with the lock held. On error the lock
+// isn't held.
+static int scull_pipe_wait_readable(struct scull_pipe_file* pf, bool nonblock, size_t count) {
+  struct scull_pipe_dev* dev = pf->dev;
+  struct scull_pipe_waiter waiter = {
+    .dev = dev,
+    .pf = pf,
+    .lowat = clamp_t(size_t, count, 1, pf->rcvlowat),
+  };
+  long timeout = pf->rcvtimeo;
+  uint64_t available;
+
+  if (mutex_lock_interruptible(&dev->read_lock)) {
+    return -ERESTARTSYS;
+  }
+  for (;;) {
+    available = scull_pipe_reader_available(pf);
+    if (available >= min(waiter.lowat, scull_pipe_capacity(dev)) ||
+        (available != 0 && (nonblock || timeout == 0))) {
+      return 1;
+    }
+    if (READ_ONCE(dev->nr_writer) == 0) {
+      return available != 0;
+    }
+    mutex_unlock(&dev->read_lock);
+    if (nonblock || timeout == 0) {
+      return -EAGAIN;
+    }
+    timeout = scull_pipe_wait_reader(pf, &waiter, timeout);
+    if (timeout < 0 || mutex_lock_interruptible(&dev->read_lock)) {
+      // The wakeup may have been for us.
+      if (!is_buffer_empty(dev)) {
+        scull_pipe_wake_readers(dev);
+      }
+      return -ERESTARTSYS;
+    }
+  }
+}
+
+// Read up to count bytes from the ring. Called with dev->read_lock held.
+static ssize_t scull_pipe_read_ring(struct scull_pipe_ring* ring, char __user* buf, size_t count) {
+  u32 read_pos = READ_ONCE(ring->ctrl->read_pos);
+  int64_t available_count = scull_pipe_window(ring, read_pos, smp_load_acquire(&ring->ctrl->write_pos),
+                                              false);
+
+  if (available_count < 0) {
+    return available_count;
   }
   if (count > available_count) {
     count = available_count;
   }
-  last_count = count;
+  if (count == 0) {
+    return 0;
+  }
+  if (scull_pipe_copy_out(ring, read_pos, buf, count) != 0) {
+    return -EFAULT;
+  }
+  smp_store_release(&ring->ctrl->read_pos, read_pos + count);
+  return count;
+}
 
-  if (dev->read_head + last_count >= dev->buffer + dev->bufsize) {
-    read_count = dev->buffer + dev->bufsize - dev->read_head;
-    if (copy_to_user(buf, dev->read_head, read_count)) {
-      retval = -EFAULT;
-      goto out_with_lock;
+// The next ring with data, round-robin, or NULL. Called with dev->read_lock
+// held.
+static struct scull_pipe_ring* scull_pipe_next_ring(struct scull_pipe_dev* dev) {
+  unsigned i;
+
+  for (i = 0; i < dev->nr_rings; ++i) {
+    struct scull_pipe_ring* ring = &dev->rings[dev->read_ring];
+    if (++dev->read_ring == dev->nr_rings) {
+      dev->read_ring = 0;
+    }
+    if (!is_ring_empty(ring)) {
+      return ring;
     }
-    last_count -= read_count;
-    buf += read_count;
-    dev->read_head = dev->buffer;
   }
-  if (last_count > 0) {
-    if (copy_to_user(buf, dev->read_head, last_count)) {
-      retval = -EFAULT;
-      goto out_with_lock;
+  return NULL;
+}
+
+// Dequeue the next record of a non-empty ring, copying up to count bytes of
+// it to buf. The rest of the record is dropped. Set *len to the record
+// length. Called with dev->read_lock held.
+static ssize_t scull_pipe_read_record(struct scull_pipe_ring* ring, char __user* buf,
+                                      size_t count, u32* len) {
+  u32 read_pos = READ_ONCE(ring->ctrl->read_pos);
+  int64_t window = scull_pipe_window(ring, read_pos, smp_load_acquire(&ring->ctrl->write_pos), true);
+
+  if (window <= 0) {
+    return window < 0 ? window : -EIO;
+  }
+  // Records are aligned to their header, so it doesn't cross pages.
+  *len = READ_ONCE(*(u32*)scull_pipe_ptr(ring->pages, ring->bufsize, read_pos));
+  if (scull_pipe_record_size(*len) > window) {
+    return -EIO;
+  }
+  if (count > *len) {
+    count = *len;
+  }
+  if (scull_pipe_copy_out(ring, read_pos + SCULL_PIPE_RECORD_HEADER, buf, count) != 0) {
+    return -EFAULT;
+  }
+  smp_store_release(&ring->ctrl->read_pos, read_pos + scull_pipe_record_size(*len));
+  return count;
+}
+
+// Move the read_pos of the ring to the slowest reader of pipe_fanout, if
+// any. Called with dev->read_lock held.
+static void scull_pipe_reclaim(struct scull_pipe_dev* dev) {
+  struct scull_pipe_ctrl* ctrl = dev->rings[0].ctrl;
+  // Cursors never pass the write_pos seen here.
+  u32 write_pos = smp_load_acquire(&ctrl->write_pos);
+  struct scull_pipe_file* pf;
+  u32 lag = 0;
+
+  if (list_empty(&dev->readers)) {
+    return;
+  }
+  list_for_each_entry(pf, &dev->readers, node) {
+    lag = max(lag, write_pos - pf->read_pos);
+  }
+  smp_store_release(&ctrl->read_pos, write_pos - lag);
+}
+
+static void scull_pipe_subscribe(struct scull_pipe_file* pf) {
+  struct scull_pipe_dev* dev = pf->dev;
+
+  mutex_lock(&dev->read_lock);
+  pf->read_pos = dev->rings[0].ctrl->read_pos;
+  list_add_tail(&pf->node, &dev->readers);
+  mutex_unlock(&dev->read_lock);
+}
+
+static void scull_pipe_unsubscribe(struct scull_pipe_file* pf) {
+  struct scull_pipe_dev* dev = pf->dev;
+
+  mutex_lock(&dev->read_lock);
+  list_del(&pf->node);
+  if (pipe_fanout == SCULL_PIPE_FANOUT_WAIT) {
+    scull_pipe_reclaim(dev);
+  }
+  mutex_unlock(&dev->read_lock);
+  scull_pipe_wake_writers(dev);
+}
+
+// Read up to count bytes at the cursor of pf, with pipe_fanout. Data the
+// writer dropped is skipped with EOVERFLOW. Called with dev->read_lock held.
+static ssize_t scull_pipe_read_cursor(struct scull_pipe_file* pf, char __user* buf, size_t count) {
+  struct scull_pipe_dev* dev = pf->dev;
+  struct scull_pipe_ring* ring = &dev->rings[0];
+  u32 read_pos = pf->read_pos;
+  u32 tail = READ_ONCE(ring->ctrl->read_pos);
+
+  if ((s32)(tail - read_pos) > 0) {
+    goto overflow;
+  }
+  count = min_t(uint64_t, count, scull_pipe_available(ring, read_pos));
+  if (count == 0) {
+    return 0;
+  }
+  if (scull_pipe_copy_out(ring, read_pos, buf, count) != 0) {
+    return -EFAULT;
+  }
+  if (pipe_fanout == SCULL_PIPE_FANOUT_OVERWRITE) {
+    // Pairs with the smp_wmb() of scull_pipe_overwrite(). If the writer
+    // moved past read_pos meanwhile, the copy may be torn.
+    smp_rmb();
+    tail = READ_ONCE(ring->ctrl->read_pos);
+    if ((s32)(tail - read_pos) > 0) {
+      goto overflow;
     }
-    dev->read_head += last_count;
   }
+  WRITE_ONCE(pf->read_pos, read_pos + count);
+  if (pipe_fanout == SCULL_PIPE_FANOUT_WAIT && read_pos == tail) {
+    scull_pipe_reclaim(dev);
+  }
+  return count;
 
-  wake_up_interruptible(&dev->writer_wq);
-  retval = count;
+overflow:
+  WRITE_ONCE(pf->read_pos, tail);
+  return -EOVERFLOW;
+}
+
+// Drop the oldest data to make room for count bytes at write_pos, with
+// SCULL_PIPE_FANOUT_OVERWRITE. Readers check read_pos again after copying,
+// so it is moved before the data is overwritten. Called with write_lock
+// held.
+static void scull_pipe_overwrite(struct scull_pipe_ring* ring, u32 write_pos, size_t count) {
+  u32 tail = write_pos + count - ring->bufsize;
+
+  if ((s32)(tail - ring->ctrl->read_pos) > 0) {
+    WRITE_ONCE(ring->ctrl->read_pos, tail);
+    smp_wmb();
+  }
+}
+
+// Whether a read of count bytes can be handed off, see struct
+// scull_pipe_handoff. Only blocking reads of the byte stream that take any
+// data, and not with the ring shared by other readers.
+static bool scull_pipe_can_handoff(struct scull_pipe_file* pf, struct file* filp, size_t count) {
+  return count != 0 && (filp->f_flags & O_NONBLOCK) == 0 && pf->rcvlowat == 1 && !pf->dev->packet &&
+         pipe_fanout == SCULL_PIPE_FANOUT_OFF && !pipe_mmap;
+}
+
+static void scull_pipe_put_handoff(struct scull_pipe_handoff* handoff) {
+  unsigned i;
+
+  if (!refcount_dec_and_test(&handoff->refs)) {
+    return;
+  }
+  for (i = 0; i < handoff->nr_pages; ++i) {
+    if (handoff->copied != 0) {
+      set_page_dirty_lock(handoff->pages[i]);
+    }
+    put_page(handoff->pages[i]);
+  }
+  kfree(handoff);
+}
+
+// Park with buf registered for a writer to copy into. Return the bytes
+// copied, an error, or 0 if the read should go through the rings after all.
+static ssize_t scull_pipe_read_handoff(struct scull_pipe_file* pf, char __user* buf, size_t count) {
+  struct scull_pipe_dev* dev = pf->dev;
+  struct scull_pipe_handoff* handoff;
+  struct scull_pipe_waiter waiter = {
+    .dev = dev,
+    .pf = pf,
+    .lowat = 1,
+  };
+  ssize_t retval = 0;
+  long timeout;
+  int nr_pages;
+
+  if (!is_buffer_empty(dev)) {
+    return 0;
+  }
+  handoff = kzalloc(sizeof(struct scull_pipe_handoff), GFP_KERNEL);
+  if (handoff == NULL) {
+    return 0;
+  }
+  refcount_set(&handoff->refs, 1);
+  handoff->offset = offset_in_page(buf);
+  waiter.handoff = handoff;
+  count = min_t(size_t, count, SCULL_PIPE_HANDOFF_PAGES * PAGE_SIZE - handoff->offset);
+  nr_pages = get_user_pages_fast((unsigned long)buf, DIV_ROUND_UP(handoff->offset + count, PAGE_SIZE),
+                                 FOLL_WRITE, handoff->pages);
+  // Faults are reported by the copy of the normal path.
+  if (nr_pages <= 0) {
+    goto out;
+  }
+  handoff->nr_pages = nr_pages;
+  handoff->count = min_t(size_t, count, nr_pages * PAGE_SIZE - handoff->offset);
+
+  spin_lock(&dev->handoff_lock);
+  if (dev->handoff != NULL || READ_ONCE(dev->nr_writer) == 0 || !is_buffer_empty(dev)) {
+    spin_unlock(&dev->handoff_lock);
+    goto out;
+  }
+  dev->handoff = handoff;
+  spin_unlock(&dev->handoff_lock);
+
+  timeout = scull_pipe_wait_reader(pf, &waiter, pf->rcvtimeo);
+  spin_lock(&dev->handoff_lock);
+  if (dev->handoff == handoff) {
+    // Not taken. The rings have data, there is no writer, or we give up.
+    dev->handoff = NULL;
+    spin_unlock(&dev->handoff_lock);
+    if (timeout < 0) {
+      retval = timeout;
+    } else if (timeout == 0 && is_buffer_empty(dev)) {
+      retval = -EAGAIN;
+    }
+    if (retval < 0 && !is_buffer_empty(dev)) {
+      scull_pipe_wake_readers(dev);
+    }
+    goto out;
+  }
+  spin_unlock(&dev->handoff_lock);
+  // Taken. The writer completes it shortly, even if we were interrupted,
+  // unless its own copy faults for long. Only a fatal signal stops waiting,
+  // the writer then puts the pages.
+  retval = wait_var_event_killable(&handoff->completed, smp_load_acquire(&handoff->completed));
+  if (retval == 0) {
+    retval = handoff->copied;
+  }
 
-out_with_lock:
-  up(&dev->sem);
 out:
-  pr_alert("scull_pipe_read retval = %zd\n", retval);
+  scull_pipe_put_handoff(handoff);
   return retval;
 }
 
-static int is_buffer_full(struct scull_pipe_dev* dev) {
-  int retval = 0;
-  if (dev->read_head < dev->write_head) {
-    if (dev->read_head == dev->buffer && dev->write_head == dev->buffer + dev->bufsize - 1) {
-      retval = 1;
+// Copy up to count bytes of buf straight to the parked reader, if the ring
+// is empty so the data stays in order. Return the bytes copied, 0 if there
+// is nothing to hand off to, or an error. Called with ring->write_lock held.
+static ssize_t scull_pipe_write_handoff(struct scull_pipe_dev* dev, struct scull_pipe_ring* ring,
+                                        const char __user* buf, size_t count) {
+  struct scull_pipe_handoff* handoff;
+  size_t copied = 0;
+  unsigned i;
+
+  spin_lock(&dev->handoff_lock);
+  handoff = dev->handoff;
+  if (handoff == NULL || !is_ring_empty(ring)) {
+    spin_unlock(&dev->handoff_lock);
+    return 0;
+  }
+  dev->handoff = NULL;
+  refcount_inc(&handoff->refs);
+  spin_unlock(&dev->handoff_lock);
+
+  count = min(count, handoff->count);
+  for (i = 0; copied < count; ++i) {
+    unsigned offset = i == 0 ? handoff->offset : 0;
+    size_t write_count = min_t(size_t, count - copied, PAGE_SIZE - offset);
+    unsigned long left = copy_from_user((char*)kmap(handoff->pages[i]) + offset, buf + copied,
+                                        write_count);
+    kunmap(handoff->pages[i]);
+    copied += write_count - left;
+    if (left != 0) {
+      break;
     }
-  } else if (dev->write_head + 1 == dev->read_head) {
-    retval = 1;
   }
-  return retval;
+  if (copied != 0) {
+    ring->bytes_written += copied;
+    ring->nr_writes++;
+    ring->bytes_handed_off += copied;
+    ring->nr_handoffs++;
+  }
+  handoff->copied = copied;
+  smp_store_release(&handoff->completed, true);
+  // Pairs with the barrier in wait_var_event_killable().
+  smp_mb();
+  wake_up_var(&handoff->completed);
+  scull_pipe_put_handoff(handoff);
+  scull_pipe_wake_readers(dev);
+  return copied != 0 ? copied : -EFAULT;
 }
 
-static ssize_t scull_pipe_write(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos) {
-  struct scull_pipe_dev* dev = filp->private_data;
+static ssize_t scull_pipe_read(struct file* filp, char __user* buf, size_t count, loff_t* f_pos) {
+  struct scull_pipe_file* pf = filp->private_data;
+  struct scull_pipe_dev* dev = pf->dev;
   ssize_t retval = 0;
-  uint64_t available_space;
-  size_t last_count, write_count;
+  unsigned i;
 
-  pr_alert("scull_pipe_write\n");
-
-  if (down_interruptible(&dev->sem)) {
-    retval = -ERESTARTSYS;
+  // Like pipe_read(), an empty read neither waits nor takes a record.
+  if (count == 0) {
+    return 0;
+  }
+  if (scull_pipe_can_handoff(pf, filp, count)) {
+    retval = scull_pipe_read_handoff(pf, buf, count);
+    if (retval != 0) {
+      return retval;
+    }
+  }
+  retval = scull_pipe_wait_readable(pf, filp->f_flags & O_NONBLOCK, count);
+  if (retval < 0) {
+    return retval;
+  }
+  if (retval == 0) {
     goto out;
   }
+  retval = 0;
 
-  while (is_buffer_full(dev)) {
-    up(&dev->sem);
-    if (filp->f_flags & O_NONBLOCK) {
+  if (pipe_fanout != SCULL_PIPE_FANOUT_OFF) {
+    retval = scull_pipe_read_cursor(pf, buf, count);
+  } else if (dev->packet) {
+    // A mapping may have emptied the rings since the wait.
+    struct scull_pipe_ring* ring = scull_pipe_next_ring(dev);
+    u32 len;
+
+    if (ring == NULL) {
       retval = -EAGAIN;
       goto out;
     }
-    if (wait_event_interruptible(dev->writer_wq, !is_buffer_full(dev))) {
-      retval = -ERESTARTSYS;
+    retval = scull_pipe_read_record(ring, buf, count, &len);
+  } else {
+    // Drain the rings round-robin, starting after the last one read from.
+    for (i = 0; i < dev->nr_rings && (size_t)retval < count; ++i) {
+      ssize_t read_count = scull_pipe_read_ring(&dev->rings[dev->read_ring], buf + retval,
+                                                count - retval);
+      if (read_count < 0) {
+        if (retval == 0) {
+          retval = read_count;
+        }
+        break;
+      }
+      retval += read_count;
+      if (++dev->read_ring == dev->nr_rings) {
+        dev->read_ring = 0;
+      }
+    }
+  }
+
+  if (retval >= 0) {
+    dev->bytes_read += retval;
+    dev->nr_reads++;
+    scull_pipe_wake_writers(dev);
+  }
+
+out:
+  scull_pipe_read_unlock(dev);
+  return retval;
+}
+
+static ssize_t scull_pipe_write(struct file* filp, const char __user* buf, size_t count, loff_t* f_pos) {
+  struct scull_pipe_file* pf = filp->private_data;
+  struct scull_pipe_dev* dev = pf->dev;
+  struct scull_pipe_ring* ring = scull_pipe_writer_ring(dev);
+  struct scull_pipe_waiter waiter = {.dev = dev, .ring = ring};
+  ssize_t retval = 0;
+  uint64_t available_space;
+  uint64_t needed_space = 1;
+  int64_t window;
+  u32 write_pos;
+  bool packet;
+
+  // With pipe_percpu, the writer may move to another CPU from here on and
+  // still fill this ring. It only costs sharing write_lock.
+  if (mutex_lock_interruptible(&ring->write_lock)) {
+    return -ERESTARTSYS;
+  }
+  // Only takes a lock if a reader is parked.
+  if (READ_ONCE(dev->handoff) != NULL && !dev->packet && count != 0) {
+    retval = scull_pipe_write_handoff(dev, ring, buf, count);
+    if (retval != 0) {
       goto out;
     }
-    if (down_interruptible(&dev->sem)) {
-      retval = -ERESTARTSYS;
+  }
+  for (;;) {
+    write_pos = READ_ONCE(ring->ctrl->write_pos);
+    packet = dev->packet;
+    if (packet) {
+      if (count == 0) {
+        goto out;
+      }
+      // A record is written whole.
+      needed_space = scull_pipe_record_size(count);
+      if (count > U32_MAX || needed_space > ring->bufsize) {
+        retval = -EMSGSIZE;
+        goto out;
+      }
+    }
+    window = scull_pipe_window(ring, smp_load_acquire(&ring->ctrl->read_pos), write_pos, packet);
+    if (window < 0) {
+      retval = window;
       goto out;
     }
+    if (pipe_fanout == SCULL_PIPE_FANOUT_OVERWRITE) {
+      available_space = ring->bufsize;
+    } else {
+      available_space = ring->bufsize - window;
+    }
+    if (available_space >= needed_space) {
+      break;
+    }
+    mutex_unlock(&ring->write_lock);
+    if (filp->f_flags & O_NONBLOCK) {
+      return -EAGAIN;
+    }
+    waiter.lowat = max_t(uint64_t, needed_space, min_t(uint64_t, pf->sndlowat, READ_ONCE(ring->bufsize)));
+    if (scull_pipe_wait(&dev->writer_wq, &waiter, MAX_SCHEDULE_TIMEOUT) < 0) {
+      return -ERESTARTSYS;
+    }
+    if (mutex_lock_interruptible(&ring->write_lock)) {
+      return -ERESTARTSYS;
+    }
   }
 
-  pr_alert("scull_pipe_write (buffer = %p, read_head = %p, write_head = %p, bufsize = %llu\n",
-           dev->buffer, dev->read_head, dev->write_head, dev->bufsize);
-
-  if (dev->read_head <= dev->write_head) {
-    available_space = dev->read_head + dev->bufsize - 1 - dev->write_head;
+  if (packet) {
+    *(u32*)scull_pipe_ptr(ring->pages, ring->bufsize, write_pos) = count;
+    if (scull_pipe_copy_in(ring, write_pos + SCULL_PIPE_RECORD_HEADER, buf, count) != 0) {
+      retval = -EFAULT;
+      goto out;
+    }
+    smp_store_release(&ring->ctrl->write_pos, write_pos + needed_space);
   } else {
-    available_space = dev->read_head - 1 - dev->write_head;
+    if (count > available_space) {
+      count = available_space;
+    }
+    if (pipe_fanout == SCULL_PIPE_FANOUT_OVERWRITE) {
+      scull_pipe_overwrite(ring, write_pos, count);
+    }
+    if (scull_pipe_copy_in(ring, write_pos, buf, count) != 0) {
+      retval = -EFAULT;
+      goto out;
+    }
+    smp_store_release(&ring->ctrl->write_pos, write_pos + count);
   }
-  if (count > available_space) {
-    count = available_space;
+  ring->bytes_written += count;
+  ring->nr_writes++;
+
+  scull_pipe_wake_readers(dev);
+  retval = count;
+
+out:
+  mutex_unlock(&ring->write_lock);
+  return retval;
+}
+
+// Dequeue up to batch->nr records with one call. Waits for the first one
+// like read(), the others are only taken if already there.
+static long scull_pipe_recv_batch(struct scull_pipe_dev* dev, struct file* filp,
+                                  struct scull_pipe_batch __user* ubatch) {
+  struct scull_pipe_batch batch;
+  struct scull_pipe_msg __user* umsgs;
+  struct scull_pipe_ring* ring;
+  unsigned nr = 0;
+  long retval = 0;
+
+  if (copy_from_user(&batch, ubatch, sizeof(batch)) != 0) {
+    return -EFAULT;
+  }
+  if (batch.nr == 0 || batch.nr > SCULL_PIPE_MAX_BATCH) {
+    return -EINVAL;
   }
-  last_count = count;
-  pr_alert("scull_pipe_write last_count = %zu\n", last_count);
+  // Don't wait for data of a byte stream to fail. The mode can still change
+  // while waiting, once the buffer is empty without a writer.
+  if (!READ_ONCE(dev->packet)) {
+    return -EINVAL;
+  }
+  umsgs = u64_to_user_ptr(batch.msgs);
+  retval = scull_pipe_wait_readable(filp->private_data, filp->f_flags & O_NONBLOCK, U32_MAX);
+  if (retval < 0) {
+    return retval;
+  }
+  if (!dev->packet) {
+    retval = -EINVAL;
+    goto out;
+  }
+  retval = 0;
+
+  while (nr < batch.nr && (ring = scull_pipe_next_ring(dev)) != NULL) {
+    struct scull_pipe_msg msg;
+    ssize_t read_count;
+    u32 len;
 
-  if (dev->write_head + last_count >= dev->buffer + dev->bufsize) {
-    write_count = dev->buffer + dev->bufsize - dev->write_head;
-    if (copy_from_user(dev->write_head, buf, write_count)) {
+    if (copy_from_user(&msg, &umsgs[nr], sizeof(msg)) != 0) {
       retval = -EFAULT;
-      goto out_with_lock;
+      break;
     }
-    last_count -= write_count;
-    buf += write_count;
-    dev->write_head = dev->buffer;
-  }
-  if (last_count > 0) {
-    if (copy_from_user(dev->write_head, buf, last_count)) {
+    read_count = scull_pipe_read_record(ring, u64_to_user_ptr(msg.buf), msg.len, &len);
+    if (read_count < 0) {
+      retval = read_count;
+      break;
+    }
+    dev->bytes_read += read_count;
+    dev->nr_reads++;
+    msg.flags = len > msg.len ? SCULL_PIPE_MSG_TRUNC : 0;
+    msg.len = len;
+    nr++;
+    if (copy_to_user(&umsgs[nr - 1], &msg, sizeof(msg)) != 0) {
       retval = -EFAULT;
-      goto out_with_lock;
+      break;
     }
-    dev->write_head += last_count;
+  }
+  if (nr != 0) {
+    scull_pipe_wake_writers(dev);
   }
 
-  wake_up_interruptible(&dev->reader_wq);
-  retval = count;
+out:
+  scull_pipe_read_unlock(dev);
+  // Records dequeued before an error are reported, like recvmmsg().
+  if (nr != 0 || retval == 0) {
+    retval = put_user(nr, &ubatch->nr);
+  }
+  return retval;
+}
 
-out_with_lock:
+// Switch between byte stream and packet mode. The buffer must be empty and
+// have no writer, so the mode can't change under a write.
+static long scull_pipe_set_packet(struct scull_pipe_dev* dev, bool packet) {
+  long retval;
+  unsigned i;
+
+  if (packet && pipe_fanout != SCULL_PIPE_FANOUT_OFF) {
+    return -EINVAL;
+  }
+  if (down_interruptible(&dev->sem)) {
+    return -ERESTARTSYS;
+  }
+  mutex_lock(&dev->read_lock);
+  retval = dev->packet;
+  if (dev->nr_writer != 0 || !is_buffer_empty(dev)) {
+    retval = -EBUSY;
+  } else {
+    // Records are aligned to their header from position 0.
+    for (i = 0; i < dev->nr_rings; ++i) {
+      WRITE_ONCE(dev->rings[i].ctrl->read_pos, 0);
+      WRITE_ONCE(dev->rings[i].ctrl->write_pos, 0);
+    }
+    dev->packet = packet;
+    for (i = 0; i < dev->nr_rings; ++i) {
+      if (dev->rings[i].ctrl_page != NULL) {
+        dev->rings[i].ctrl->flags = packet ? SCULL_PIPE_CTRL_PACKET : 0;
+      }
+    }
+  }
+  mutex_unlock(&dev->read_lock);
   up(&dev->sem);
+  return retval;
+}
+
+static void scull_pipe_spd_release(struct splice_pipe_desc* spd, unsigned int i) {
+  put_page(spd->pages[i]);
+}
+
+// Splice data of the next ring to pipe. Whole pages of data are moved to the
+// pipe and replaced by new pages in the ring, partial ones are copied. Called
+// by splice with pipe locked, after waiting for room in it.
+static ssize_t scull_pipe_splice_read(struct file* filp, loff_t* ppos, struct pipe_inode_info* pipe,
+                                      size_t len, unsigned int flags) {
+  struct scull_pipe_file* pf = filp->private_data;
+  struct scull_pipe_dev* dev = pf->dev;
+  struct page* pages[PIPE_DEF_BUFFERS];
+  struct partial_page partial[PIPE_DEF_BUFFERS];
+  struct splice_pipe_desc spd = {
+    .pages = pages,
+    .partial = partial,
+    .nr_pages_max = PIPE_DEF_BUFFERS,
+    .ops = &scull_pipe_buf_ops,
+    .spd_release = scull_pipe_spd_release,
+  };
+  // Data taken from the ring must all fit in the pipe.
+  unsigned max_pages = min_t(unsigned, PIPE_DEF_BUFFERS, pipe->buffers - pipe->nrbufs);
+  struct scull_pipe_ring* ring;
+  int64_t window;
+  u32 read_pos;
+  ssize_t retval;
+
+  if (pipe->readers == 0) {
+    send_sig(SIGPIPE, current, 0);
+    return -EPIPE;
+  }
+  if (max_pages == 0) {
+    return -EAGAIN;
+  }
+  retval = scull_pipe_wait_readable(pf, (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK), len);
+  if (retval <= 0) {
+    if (retval == 0) {
+      scull_pipe_read_unlock(dev);
+    }
+    return retval;
+  }
+  // Pages of a fan-out ring are read by all readers, they can't be moved.
+  if (dev->packet || pipe_fanout != SCULL_PIPE_FANOUT_OFF) {
+    retval = -EINVAL;
+    goto out;
+  }
+
+  // A mapping may have emptied the rings since the wait.
+  ring = scull_pipe_next_ring(dev);
+  if (ring == NULL) {
+    retval = -EAGAIN;
+    goto out;
+  }
+  read_pos = READ_ONCE(ring->ctrl->read_pos);
+  window = scull_pipe_window(ring, read_pos, smp_load_acquire(&ring->ctrl->write_pos), false);
+  if (window < 0) {
+    retval = window;
+    goto out;
+  }
+  len = min_t(uint64_t, len, window);
+  while (spd.nr_pages < max_pages && len != 0) {
+    unsigned offset = offset_in_page(read_pos);
+    unsigned count = min_t(size_t, len, PAGE_SIZE - offset);
+    struct page* page = alloc_pages_node(ring->node, GFP_KERNEL_ACCOUNT, 0);
+
+    if (page == NULL) {
+      break;
+    }
+    if (count == PAGE_SIZE && !pipe_mmap) {
+      // The writer doesn't touch a slot full of data.
+      swap(ring->pages[(read_pos & (ring->bufsize - 1)) >> PAGE_SHIFT], page);
+    } else {
+      memcpy(page_address(page), scull_pipe_ptr(ring->pages, ring->bufsize, read_pos), count);
+      offset = 0;
+    }
+    pages[spd.nr_pages] = page;
+    partial[spd.nr_pages].offset = offset;
+    partial[spd.nr_pages].len = count;
+    spd.nr_pages++;
+    read_pos += count;
+    len -= count;
+  }
+  if (spd.nr_pages == 0) {
+    retval = -ENOMEM;
+    goto out;
+  }
+  dev->bytes_read += read_pos - READ_ONCE(ring->ctrl->read_pos);
+  dev->nr_reads++;
+  smp_store_release(&ring->ctrl->read_pos, read_pos);
+  scull_pipe_read_unlock(dev);
+  scull_pipe_wake_writers(dev);
+  return splice_to_pipe(pipe, &spd);
+
+out:
+  scull_pipe_read_unlock(dev);
+  return retval;
+}
+
+// Move buf into the ring of this CPU. A whole page that can be stolen, like
+// one gifted with vmsplice(SPLICE_F_GIFT), takes the place of a free ring
+// page, other data is copied.
+static int scull_pipe_splice_actor(struct pipe_inode_info* pipe, struct pipe_buffer* buf,
+                                   struct splice_desc* sd) {
+  struct file* filp = sd->u.file;
+  struct scull_pipe_file* pf = filp->private_data;
+  struct scull_pipe_dev* dev = pf->dev;
+  struct scull_pipe_ring* ring = scull_pipe_writer_ring(dev);
+  struct scull_pipe_waiter waiter = {.dev = dev, .ring = ring};
+  int64_t window;
+  u32 write_pos;
+  size_t count, copied;
+  char* src;
+  int retval;
+
+  retval = pipe_buf_confirm(pipe, buf);
+  if (retval != 0) {
+    return retval;
+  }
+  if (mutex_lock_interruptible(&ring->write_lock)) {
+    return -ERESTARTSYS;
+  }
+  for (;;) {
+    write_pos = READ_ONCE(ring->ctrl->write_pos);
+    window = scull_pipe_window(ring, smp_load_acquire(&ring->ctrl->read_pos), write_pos, false);
+    if (window < 0) {
+      mutex_unlock(&ring->write_lock);
+      return window;
+    }
+    if (window < ring->bufsize) {
+      break;
+    }
+    mutex_unlock(&ring->write_lock);
+    if ((filp->f_flags & O_NONBLOCK) || (sd->flags & SPLICE_F_NONBLOCK)) {
+      return -EAGAIN;
+    }
+    waiter.lowat = min_t(uint64_t, pf->sndlowat, READ_ONCE(ring->bufsize));
+    if (scull_pipe_wait(&dev->writer_wq, &waiter, MAX_SCHEDULE_TIMEOUT) < 0) {
+      return -ERESTARTSYS;
+    }
+    if (mutex_lock_interruptible(&ring->write_lock)) {
+      return -ERESTARTSYS;
+    }
+  }
+  count = min_t(uint64_t, sd->len, ring->bufsize - window);
+
+  if (count == PAGE_SIZE && !pipe_mmap && buf->offset == 0 && offset_in_page(write_pos) == 0 &&
+      !PageHighMem(buf->page) && pipe_buf_steal(pipe, buf) == 0) {
+    // The reader doesn't touch a free slot. The pipe keeps its reference
+    // until the buffer is released.
+    struct page** slot = &ring->pages[(write_pos & (ring->bufsize - 1)) >> PAGE_SHIFT];
+    get_page(buf->page);
+    unlock_page(buf->page);
+    put_page(*slot);
+    *slot = buf->page;
+  } else {
+    src = kmap_atomic(buf->page);
+    for (copied = 0; copied < count;) {
+      size_t write_count = min_t(size_t, count - copied, PAGE_SIZE - offset_in_page(write_pos + copied));
+      memcpy(scull_pipe_ptr(ring->pages, ring->bufsize, write_pos + copied),
+             src + buf->offset + copied, write_count);
+      copied += write_count;
+    }
+    kunmap_atomic(src);
+  }
+  smp_store_release(&ring->ctrl->write_pos, write_pos + count);
+  ring->bytes_written += count;
+  ring->nr_writes++;
+  mutex_unlock(&ring->write_lock);
+  scull_pipe_wake_readers(dev);
+  return count;
+}
+
+static ssize_t scull_pipe_splice_write(struct pipe_inode_info* pipe, struct file* filp, loff_t* ppos,
+                                       size_t len, unsigned int flags) {
+  struct scull_pipe_dev* dev = ((struct scull_pipe_file*)filp->private_data)->dev;
+
+  // Records can't be told apart in a pipe. Lagging readers may still copy
+  // out of a page that would be replaced.
+  if (dev->packet || pipe_fanout == SCULL_PIPE_FANOUT_OVERWRITE) {
+    return -EINVAL;
+  }
+  return splice_from_pipe(pipe, filp, ppos, len, flags, scull_pipe_splice_actor);
+}
+
+// Move the ring to the new pages, of bufsize bytes, and return the old ones.
+// The data keeps its positions, at their offsets in the new ring. Called with
+// dev->read_lock and ring->write_lock held.
+static struct page** scull_pipe_move_ring(struct scull_pipe_ring* ring, struct page** pages,
+                                          uint64_t bufsize) {
+  struct page** old_pages = ring->pages;
+  u32 pos;
+
+  for (pos = ring->ctrl->read_pos; pos != ring->ctrl->write_pos;) {
+    size_t count = min_t(size_t, ring->ctrl->write_pos - pos, PAGE_SIZE - offset_in_page(pos));
+    memcpy(scull_pipe_ptr(pages, bufsize, pos), scull_pipe_ptr(ring->pages, ring->bufsize, pos),
+           count);
+    pos += count;
+  }
+  ring->pages = pages;
+  WRITE_ONCE(ring->bufsize, bufsize);
+  ring->ctrl->bufsize = bufsize;
+  return old_pages;
+}
+
+// Resize all the rings with pages, or none of them. The new pages are all
+// allocated first, then the rings are moved to them with every lock held,
+// once the data of each is known to fit.
+static long scull_pipe_set_bufsize(struct scull_pipe_dev* dev, unsigned long size) {
+  struct page*** pages;
+  uint64_t bufsize, old_bufsize = 0;
+  unsigned long nr_pages = 0, old_nr_pages;
+  long retval = 0;
+  unsigned i;
+
+  if (size == 0 || size > SCULL_PIPE_MAX_BUFSIZE) {
+    return -EINVAL;
+  }
+  if (size > pipe_max_size && !capable(CAP_SYS_RESOURCE)) {
+    return -EPERM;
+  }
+  // Mappings would keep the old pages.
+  if (pipe_mmap) {
+    return -EBUSY;
+  }
+  bufsize = roundup_pow_of_two(max(size, PAGE_SIZE));
+  pages = kcalloc(dev->nr_rings, sizeof(struct page**), GFP_KERNEL);
+  if (pages == NULL) {
+    return -ENOMEM;
+  }
+  // sem serializes resizes.
+  if (down_interruptible(&dev->sem)) {
+    retval = -ERESTARTSYS;
+    goto out_free;
+  }
+  for (i = 0; i < dev->nr_rings; ++i) {
+    if (dev->rings[i].pages != NULL) {
+      old_bufsize = dev->rings[i].bufsize;
+      nr_pages += bufsize >> PAGE_SHIFT;
+    }
+  }
+  if (old_bufsize == bufsize) {
+    goto out;
+  }
+  // Like pipe_set_size(), the pages are charged before they are allocated.
+  old_nr_pages = dev->user_pages;
+  if (scull_pipe_account(dev, nr_pages) > pipe_user_pages && pipe_user_pages != 0 &&
+      nr_pages > old_nr_pages && !capable(CAP_SYS_RESOURCE)) {
+    retval = -EPERM;
+    goto out_unaccount;
+  }
+  for (i = 0; i < dev->nr_rings; ++i) {
+    if (dev->rings[i].pages == NULL) {
+      continue;
+    }
+    pages[i] = scull_pipe_alloc_pages(bufsize >> PAGE_SHIFT, dev->rings[i].node);
+    if (pages[i] == NULL) {
+      retval = -ENOMEM;
+      goto out_unaccount;
+    }
+  }
+
+  mutex_lock(&dev->read_lock);
+  for (i = 0; i < dev->nr_rings; ++i) {
+    mutex_lock_nest_lock(&dev->rings[i].write_lock, &dev->read_lock);
+  }
+  for (i = 0; i < dev->nr_rings; ++i) {
+    struct scull_pipe_ring* ring = &dev->rings[i];
+    if (ring->pages != NULL && ring->ctrl->write_pos - ring->ctrl->read_pos > bufsize) {
+      retval = -EBUSY;
+    }
+  }
+  // On success, the old pages take the place of the new ones to be freed.
+  for (i = 0; i < dev->nr_rings && retval == 0; ++i) {
+    if (pages[i] != NULL) {
+      pages[i] = scull_pipe_move_ring(&dev->rings[i], pages[i], bufsize);
+    }
+  }
+  for (i = 0; i < dev->nr_rings; ++i) {
+    mutex_unlock(&dev->rings[i].write_lock);
+  }
+  mutex_unlock(&dev->read_lock);
+  if (retval == 0) {
+    old_nr_pages = nr_pages;
+  }
+
+out_unaccount:
+  scull_pipe_account(dev, old_nr_pages);
 out:
-  pr_alert("scull_pipe_write retval = %zd\n", retval);
+  up(&dev->sem);
+  for (i = 0; i < dev->nr_rings; ++i) {
+    scull_pipe_free_pages(pages[i], (retval == 0 ? old_bufsize : bufsize) >> PAGE_SHIFT);
+  }
+  // Readers may be waiting for more than the smaller rings hold.
+  scull_pipe_wake_readers(dev);
+  scull_pipe_wake_writers(dev);
+out_free:
+  kfree(pages);
+  return retval == 0 ? bufsize : retval;
+}
+
+// Totals of the rings are summed without their locks, they may be a little
+// behind while writers run.
+static long scull_pipe_get_stats(struct scull_pipe_dev* dev, struct scull_pipe_stats __user* ustats) {
+  struct scull_pipe_stats stats = {};
+  unsigned i;
+
+  mutex_lock(&dev->read_lock);
+  stats.bytes_read = dev->bytes_read;
+  stats.nr_reads = dev->nr_reads;
+  mutex_unlock(&dev->read_lock);
+  for (i = 0; i < dev->nr_rings; ++i) {
+    stats.bytes_written += READ_ONCE(dev->rings[i].bytes_written);
+    stats.nr_writes += READ_ONCE(dev->rings[i].nr_writes);
+    stats.bytes_read += READ_ONCE(dev->rings[i].bytes_handed_off);
+    stats.nr_reads += READ_ONCE(dev->rings[i].nr_handoffs);
+  }
+  return copy_to_user(ustats, &stats, sizeof(stats)) != 0 ? -EFAULT : 0;
+}
+
+// Map the control page and the data of the ring, see struct
+// scull_pipe_ctrl. The pages never move with pipe_mmap, so they are all
+// inserted up front.
+static int scull_pipe_mmap(struct file* filp, struct vm_area_struct* vma) {
+  struct scull_pipe_dev* dev = ((struct scull_pipe_file*)filp->private_data)->dev;
+  struct scull_pipe_ring* ring = &dev->rings[0];
+  unsigned long addr = vma->vm_start;
+  unsigned i;
+  int err;
+
+  if (!pipe_mmap || dev->nr_rings != 1) {
+    return -ENODEV;
+  }
+  if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE + ring->bufsize ||
+      (vma->vm_flags & VM_SHARED) == 0) {
+    return -EINVAL;
+  }
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+  err = vm_insert_page(vma, addr, ring->ctrl_page);
+  for (i = 0; err == 0 && i < ring->bufsize >> PAGE_SHIFT; ++i) {
+    addr += PAGE_SIZE;
+    err = vm_insert_page(vma, addr, ring->pages[i]);
+  }
+  return err;
+}
+
+static long scull_pipe_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+  struct scull_pipe_file* pf = filp->private_data;
+  struct scull_pipe_dev* dev = pf->dev;
+  long retval = 0;
+
+  if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC ||
+      !(_IOC_NR(cmd) >= SCULL_IOC_NR_FIRST && _IOC_NR(cmd) < SCULL_IOC_NR_LAST)) {
+    return -ENOTTY;
+  }
+  switch (cmd) {
+    case SCULL_IOC_GET_PACKET:
+      retval = dev->packet;
+      break;
+    case SCULL_IOC_SET_PACKET:
+      retval = scull_pipe_set_packet(dev, arg != 0);
+      break;
+    case SCULL_IOC_RECV_BATCH:
+      retval = scull_pipe_recv_batch(dev, filp, (void __user*)arg);
+      break;
+    case SCULL_IOC_GET_BUFSIZE:
+      retval = READ_ONCE(dev->rings[0].bufsize);
+      break;
+    case SCULL_IOC_SET_BUFSIZE:
+      retval = scull_pipe_set_bufsize(dev, arg);
+      break;
+    case SCULL_IOC_DOORBELL:
+      scull_pipe_wake_readers(dev);
+      scull_pipe_wake_writers(dev);
+      break;
+    case SCULL_IOC_SET_RCVLOWAT:
+      retval = pf->rcvlowat;
+      pf->rcvlowat = clamp_t(unsigned long, arg, 1, SCULL_PIPE_MAX_BUFSIZE);
+      break;
+    case SCULL_IOC_SET_SNDLOWAT:
+      retval = pf->sndlowat;
+      pf->sndlowat = clamp_t(unsigned long, arg, 1, SCULL_PIPE_MAX_BUFSIZE);
+      break;
+    case SCULL_IOC_SET_RCVTIMEO:
+      retval = pf->rcvtimeo == MAX_SCHEDULE_TIMEOUT ? 0 : jiffies_to_msecs(pf->rcvtimeo);
+      pf->rcvtimeo = arg == 0 || arg >= INT_MAX ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(arg);
+      break;
+    case SCULL_IOC_GET_STATS:
+      retval = scull_pipe_get_stats(dev, (void __user*)arg);
+      break;
+    case SCULL_IOC_SET_BUSY_POLL:
+      // Like SO_BUSY_POLL, spinning longer than the default takes privilege.
+      arg = min_t(unsigned long, arg, SCULL_PIPE_MAX_BUSY_POLL);
+      if (arg > pipe_busy_read && !capable(CAP_NET_ADMIN) && !capable(CAP_SYS_NICE)) {
+        return -EPERM;
+      }
+      retval = pf->busy_poll;
+      WRITE_ONCE(pf->busy_poll, arg);
+      break;
+    default:
+      retval = -ENOTTY;
+  }
   return retval;
 }
 
+// Readable and writable past the watermarks of filp, or readable with any
+// data once there is no writer.
 static unsigned int scull_pipe_poll(struct file* filp, struct poll_table_struct* poll_table) {
-  struct scull_pipe_dev* dev = filp->private_data;
+  struct scull_pipe_file* pf = filp->private_data;
+  struct scull_pipe_dev* dev = pf->dev;
+  struct scull_pipe_ring* ring = scull_pipe_writer_ring(dev);
   unsigned int mask = 0;
+  uint64_t available;
 
-  pr_alert("scull_pipe_poll\n");
-
-  down(&dev->sem);
-  poll_wait(filp, &dev->reader_wq, poll_table);
-  poll_wait(filp, &dev->writer_wq, poll_table);
-  if (!is_buffer_empty(dev)) {
+  // Only wait for the sides of filp, so an exclusive epoll entry is only
+  // woken up for them.
+  if ((filp->f_flags & O_ACCMODE) != O_WRONLY) {
+    poll_wait(filp, &dev->reader_wq, poll_table);
+  }
+  if ((filp->f_flags & O_ACCMODE) != O_RDONLY) {
+    poll_wait(filp, &dev->writer_wq, poll_table);
+  }
+  if ((filp->f_flags & O_ACCMODE) == O_RDONLY) {
+    available = scull_pipe_reader_available(pf);
+  } else {
+    available = scull_pipe_buffer_available(dev);
+  }
+  if (available >= min_t(uint64_t, pf->rcvlowat, scull_pipe_capacity(dev)) ||
+      (available != 0 && READ_ONCE(dev->nr_writer) == 0)) {
     mask |= POLLIN | POLLRDNORM;
   }
-  if (!is_buffer_full(dev)) {
-    mask |= POLLOUT | POLLRDNORM;
+  if (pipe_fanout == SCULL_PIPE_FANOUT_OVERWRITE ||
+      scull_pipe_space(ring, READ_ONCE(ring->ctrl->write_pos)) >=
+      min_t(uint64_t, pf->sndlowat, READ_ONCE(ring->bufsize))) {
+    mask |= POLLOUT | POLLWRNORM;
   }
-  if ((filp->f_flags & O_ACCMODE) == O_RDONLY && is_buffer_empty_and_has_no_writer(dev)) {
+  if ((filp->f_flags & O_ACCMODE) == O_RDONLY && available == 0 && READ_ONCE(dev->nr_writer) == 0) {
     mask |= POLLHUP;
   }
-
-  up(&dev->sem);
   return mask;
 }
 
@@ -372,6 +372,7 @@ static ssize_t scull_write(struct file* filp, const char __user* buf, size_t cou
       }
       dptr->next = NULL;
       dptr->data = NULL;
+      dptr->info = NULL;
       if (prev_qset != NULL) {
         prev_qset->next = dptr;
       } else {
@@ -1,10 +1,17 @@
 #include <gtest/gtest.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/ioctl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
 #define SCULL_IOC_MAGIC 'z'
 enum {
   SCULL_IOC_NR_FIRST = 0x80,
@@ -13,14 +20,72 @@ enum {
   SCULL_IOC_NR_SET_QUANTUM,
   SCULL_IOC_NR_GET_QSET,
   SCULL_IOC_NR_SET_QSET,
+  SCULL_IOC_NR_GET_MEM_LIMIT,
+  SCULL_IOC_NR_SET_MEM_LIMIT,
+  SCULL_IOC_NR_GET_MEM_BLOCK,
+  SCULL_IOC_NR_SET_MEM_BLOCK,
+  SCULL_IOC_NR_GET_SIZE,
+  SCULL_IOC_NR_KV_PUT,
+  SCULL_IOC_NR_KV_GET,
+  SCULL_IOC_NR_KV_DELETE,
+  SCULL_IOC_NR_KV_MULTI_GET,
+  SCULL_IOC_NR_SNAPSHOT,
+  SCULL_IOC_NR_CHECKSUM,
   SCULL_IOC_NR_LAST,
 };
 
+struct scull_kv_req {
+  __u64 key;
+  __u64 value;
+  __u32 key_len;
+  __u32 value_len;
+  __s32 status;
+  __u32 reserved;
+};
+
+struct scull_kv_batch {
+  __u64 reqs;
+  __u32 nr;
+  __u32 reserved;
+};
+
+struct scull_csum_req {
+  __u64 pos;
+  __u64 crcs;
+  __u32 nr;
+  __u32 flags;
+  __u32 quantum;
+  __u32 range_crc;
+  __u32 nr_bad;
+  __u32 reserved;
+  __u64 first_bad;
+};
+
+#define SCULL_CSUM_VERIFY 1
+
+struct scull_log_hole {
+  __u32 magic;
+  __u32 reserved;
+  __u64 len;
+};
+
+#define SCULL_LOG_HOLE_MAGIC 0x484c4353
+
 #define SCULL_IOC_RESET_QUANTUM_QSET  _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_RESET_QUANTUM_QSET)
 #define SCULL_IOC_GET_QUANTUM _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_QUANTUM)
 #define SCULL_IOC_SET_QUANTUM _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_QUANTUM)
 #define SCULL_IOC_GET_QSET    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_QSET)
 #define SCULL_IOC_SET_QSET    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_QSET)
+#define SCULL_IOC_GET_MEM_LIMIT _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_MEM_LIMIT)
+#define SCULL_IOC_SET_MEM_LIMIT _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_MEM_LIMIT)
+#define SCULL_IOC_GET_MEM_BLOCK _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_MEM_BLOCK)
+#define SCULL_IOC_SET_MEM_BLOCK _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_SET_MEM_BLOCK)
+#define SCULL_IOC_GET_SIZE    _IO(SCULL_IOC_MAGIC, SCULL_IOC_NR_GET_SIZE)
+#define SCULL_IOC_KV_PUT      _IOW(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_PUT, struct scull_kv_req)
+#define SCULL_IOC_KV_GET      _IOWR(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_GET, struct scull_kv_req)
+#define SCULL_IOC_KV_DELETE   _IOW(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_DELETE, struct scull_kv_req)
+#define SCULL_IOC_KV_MULTI_GET _IOWR(SCULL_IOC_MAGIC, SCULL_IOC_NR_KV_MULTI_GET, struct scull_kv_batch)
+#define SCULL_IOC_CHECKSUM    _IOWR(SCULL_IOC_MAGIC, SCULL_IOC_NR_CHECKSUM, struct scull_csum_req)
 
 TEST(scull_dev, ioctl) {
   const char* filename = "../scull_dev0";
@@ -43,3 +108,220 @@ TEST(scull_dev, ioctl) {
 
   ASSERT_EQ(0, close(fd));
 }
+
+TEST(scull_dev, mem_limit) {
+  const char* filename = "../scull_dev0";
+  int fd = open(filename, O_WRONLY);
+  ASSERT_NE(-1, fd);
+  long original_limit = ioctl(fd, SCULL_IOC_GET_MEM_LIMIT);
+  long original_block = ioctl(fd, SCULL_IOC_GET_MEM_BLOCK);
+  ASSERT_EQ(original_limit, ioctl(fd, SCULL_IOC_SET_MEM_LIMIT, 4096));
+  ASSERT_EQ(original_block, ioctl(fd, SCULL_IOC_SET_MEM_BLOCK, 0));
+
+  // The device was trimmed by open(O_WRONLY), so only the first 4096 bytes fit.
+  std::vector<char> buf(8192, 'a');
+  ASSERT_EQ(4096, write(fd, buf.data(), buf.size()));
+  ASSERT_EQ(-1, write(fd, buf.data(), buf.size()));
+  ASSERT_EQ(ENOSPC, errno);
+
+  // Only writers can change the quota.
+  int rfd = open(filename, O_RDONLY);
+  ASSERT_NE(-1, rfd);
+  ASSERT_EQ(-1, ioctl(rfd, SCULL_IOC_SET_MEM_LIMIT, 0));
+  ASSERT_EQ(EBADF, errno);
+  ASSERT_EQ(0, close(rfd));
+
+  ASSERT_EQ(4096, ioctl(fd, SCULL_IOC_SET_MEM_LIMIT, original_limit));
+  ASSERT_EQ(0, ioctl(fd, SCULL_IOC_SET_MEM_BLOCK, original_block));
+  ASSERT_EQ(0, close(fd));
+}
+
+TEST(scull_dev, size_and_poll) {
+  const char* filename = "../scull_dev0";
+  int wfd = open(filename, O_WRONLY);
+  ASSERT_NE(-1, wfd);
+  int rfd = open(filename, O_RDONLY);
+  ASSERT_NE(-1, rfd);
+  ASSERT_EQ(0, ioctl(rfd, SCULL_IOC_GET_SIZE));
+
+  struct pollfd pfd = {rfd, POLLIN, 0};
+  ASSERT_EQ(0, poll(&pfd, 1, 0));
+
+  std::vector<char> buf(100, 'a');
+  ASSERT_EQ(100, write(wfd, buf.data(), buf.size()));
+  ASSERT_EQ(100, ioctl(rfd, SCULL_IOC_GET_SIZE));
+  ASSERT_EQ(1, poll(&pfd, 1, 0));
+  ASSERT_TRUE(pfd.revents & POLLIN);
+
+  ASSERT_EQ(100, lseek(rfd, 0, SEEK_END));
+  ASSERT_EQ(90, lseek(rfd, -10, SEEK_CUR));
+  pfd.revents = 0;
+  ASSERT_EQ(1, poll(&pfd, 1, 0));
+
+  ASSERT_EQ(0, close(rfd));
+  ASSERT_EQ(0, close(wfd));
+}
+
+static scull_kv_req kv_req(const std::string& key, void* value, size_t value_len) {
+  scull_kv_req req = {};
+  req.key = reinterpret_cast<__u64>(key.data());
+  req.key_len = key.size();
+  req.value = reinterpret_cast<__u64>(value);
+  req.value_len = value_len;
+  return req;
+}
+
+TEST(scull_dev, kv) {
+  const char* filename = "../scull_dev0";
+  int fd = open(filename, O_RDWR);
+  ASSERT_NE(-1, fd);
+
+  std::string one = "one", two = "two", three = "three";
+  std::string v1 = "first value", v2 = "2";
+  scull_kv_req req = kv_req(one, &v1[0], v1.size());
+  ASSERT_EQ(0, ioctl(fd, SCULL_IOC_KV_PUT, &req));
+  req = kv_req(two, &v2[0], v2.size());
+  ASSERT_EQ(0, ioctl(fd, SCULL_IOC_KV_PUT, &req));
+
+  char small[4];
+  req = kv_req(one, small, sizeof(small));
+  ASSERT_EQ(-1, ioctl(fd, SCULL_IOC_KV_GET, &req));
+  ASSERT_EQ(EMSGSIZE, errno);
+  ASSERT_EQ(v1.size(), req.value_len);
+
+  char buf1[32], buf2[32], buf3[32];
+  scull_kv_req reqs[3] = {kv_req(one, buf1, sizeof(buf1)), kv_req(two, buf2, sizeof(buf2)),
+                          kv_req(three, buf3, sizeof(buf3))};
+  scull_kv_batch batch = {reinterpret_cast<__u64>(reqs), 3, 0};
+  ASSERT_EQ(0, ioctl(fd, SCULL_IOC_KV_MULTI_GET, &batch));
+  ASSERT_EQ(0, reqs[0].status);
+  ASSERT_EQ(v1, std::string(buf1, reqs[0].value_len));
+  ASSERT_EQ(0, reqs[1].status);
+  ASSERT_EQ(v2, std::string(buf2, reqs[1].value_len));
+  ASSERT_EQ(-ENOENT, reqs[2].status);
+
+  req = kv_req(one, NULL, 0);
+  ASSERT_EQ(0, ioctl(fd, SCULL_IOC_KV_DELETE, &req));
+  req = kv_req(one, buf1, sizeof(buf1));
+  ASSERT_EQ(-1, ioctl(fd, SCULL_IOC_KV_GET, &req));
+  ASSERT_EQ(ENOENT, errno);
+
+  // Values aren't read through a write-only file, nor put through a
+  // read-only one.
+  int rfd = open(filename, O_RDONLY);
+  ASSERT_NE(-1, rfd);
+  req = kv_req(two, &v2[0], v2.size());
+  ASSERT_EQ(-1, ioctl(rfd, SCULL_IOC_KV_PUT, &req));
+  ASSERT_EQ(EBADF, errno);
+  ASSERT_EQ(0, close(rfd));
+  int wfd = open(filename, O_WRONLY | O_APPEND);
+  ASSERT_NE(-1, wfd);
+  req = kv_req(two, buf2, sizeof(buf2));
+  ASSERT_EQ(-1, ioctl(wfd, SCULL_IOC_KV_GET, &req));
+  ASSERT_EQ(EBADF, errno);
+  ASSERT_EQ(0, close(wfd));
+
+  ASSERT_EQ(0, close(fd));
+}
+
+// crc32c with seed 0 and no final xor, like the kernel's crc32c(0, ...).
+static uint32_t crc32c_raw(uint32_t crc, const char* p, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= static_cast<unsigned char>(p[i]);
+    for (int k = 0; k < 8; ++k) {
+      crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+  }
+  return crc;
+}
+
+TEST(scull_dev, checksum) {
+  const char* filename = "../scull_dev0";
+  int fd = open(filename, O_WRONLY);
+  ASSERT_NE(-1, fd);
+  long quantum = ioctl(fd, SCULL_IOC_GET_QUANTUM);
+  ASSERT_GT(quantum, 0);
+
+  // A full quantum, then a partial one written in two pieces.
+  std::vector<char> data(quantum + quantum / 2, 'a');
+  ASSERT_EQ((ssize_t)data.size() - 10, write(fd, data.data(), data.size() - 10));
+  ASSERT_EQ(10, write(fd, data.data(), 10));
+
+  uint32_t crcs[4];
+  scull_csum_req req = {};
+  req.pos = 0;
+  req.crcs = reinterpret_cast<__u64>(crcs);
+  req.nr = 4;
+  req.flags = SCULL_CSUM_VERIFY;
+  ASSERT_EQ(0, ioctl(fd, SCULL_IOC_CHECKSUM, &req));
+  ASSERT_EQ(2, req.nr);
+  ASSERT_EQ(quantum, req.quantum);
+  ASSERT_EQ(0, req.nr_bad);
+
+  std::vector<char> padded(2 * quantum, 0);
+  std::copy(data.begin(), data.end(), padded.begin());
+  ASSERT_EQ(crc32c_raw(0, padded.data(), quantum), crcs[0]);
+  ASSERT_EQ(crc32c_raw(0, padded.data() + quantum, quantum), crcs[1]);
+  ASSERT_EQ(crc32c_raw(0, padded.data(), padded.size()), req.range_crc);
+
+  ASSERT_EQ(0, close(fd));
+}
+
+TEST(scull_dev, log_hole) {
+  const char* filename = "../scull_dev0";
+  int fd = open(filename, O_WRONLY);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(0, close(fd));
+  int afd = open(filename, O_WRONLY | O_APPEND);
+  ASSERT_NE(-1, afd);
+  int rfd = open(filename, O_RDONLY);
+  ASSERT_NE(-1, rfd);
+
+  // The failed append still takes its place in the log, as a hole record.
+  std::string record = "record";
+  ASSERT_EQ((ssize_t)record.size(), write(afd, record.data(), record.size()));
+  ASSERT_EQ(-1, write(afd, reinterpret_cast<const void*>(8), 64));
+  ASSERT_EQ(EFAULT, errno);
+  ASSERT_EQ((ssize_t)record.size(), write(afd, record.data(), record.size()));
+
+  std::vector<char> buf(2 * record.size() + 64);
+  ASSERT_EQ((ssize_t)buf.size(), read(rfd, buf.data(), buf.size()));
+  ASSERT_EQ(record, std::string(buf.data(), record.size()));
+  scull_log_hole hole;
+  memcpy(&hole, buf.data() + record.size(), sizeof(hole));
+  ASSERT_EQ(SCULL_LOG_HOLE_MAGIC, hole.magic);
+  ASSERT_EQ(64, hole.len);
+  ASSERT_TRUE(std::all_of(buf.begin() + record.size() + sizeof(hole), buf.begin() + record.size() + 64,
+                          [](char c) { return c == 0; }));
+  ASSERT_EQ(record, std::string(buf.data() + record.size() + 64, record.size()));
+
+  ASSERT_EQ(0, close(rfd));
+  ASSERT_EQ(0, close(afd));
+}
+
+TEST(scull_dev, log_and_positional_write) {
+  const char* filename = "../scull_dev0";
+  int fd = open(filename, O_WRONLY);
+  ASSERT_NE(-1, fd);
+  int afd = open(filename, O_WRONLY | O_APPEND);
+  ASSERT_NE(-1, afd);
+  int rfd = open(filename, O_RDONLY);
+  ASSERT_NE(-1, rfd);
+
+  // A positional write past the log end moves the next append after it.
+  ASSERT_EQ(4, write(afd, "1111", 4));
+  ASSERT_EQ(4, lseek(fd, 4, SEEK_SET));
+  ASSERT_EQ(4, write(fd, "2222", 4));
+  ASSERT_EQ(4, write(afd, "3333", 4));
+  // One below the log end just overwrites.
+  ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+  ASSERT_EQ(2, write(fd, "00", 2));
+
+  char buf[16];
+  ASSERT_EQ(12, read(rfd, buf, sizeof(buf)));
+  ASSERT_EQ("001122223333", std::string(buf, 12));
+
+  ASSERT_EQ(0, close(rfd));
+  ASSERT_EQ(0, close(afd));
+  ASSERT_EQ(0, close(fd));
+}
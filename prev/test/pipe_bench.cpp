@@ -0,0 +1,73 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const char* bench_pipe_filename = "../scull_pipe_dev";
+
+static void bench_write_fn(size_t total_bytes, size_t chunk_bytes) {
+  int pipe_fd = open(bench_pipe_filename, O_WRONLY);
+  ASSERT_NE(-1, pipe_fd);
+
+  std::vector<char> buf(chunk_bytes, 'x');
+  size_t last_bytes = total_bytes;
+  while (last_bytes > 0) {
+    ssize_t write_bytes = TEMP_FAILURE_RETRY(write(pipe_fd, buf.data(), std::min(last_bytes, chunk_bytes)));
+    ASSERT_GT(write_bytes, 0);
+    last_bytes -= write_bytes;
+  }
+
+  ASSERT_EQ(0, close(pipe_fd));
+}
+
+// nr_writers writers and one reader stream total_bytes through the pipe in
+// chunk_bytes transfers.
+static void bench_pipe(size_t total_bytes, size_t chunk_bytes, size_t nr_writers = 1) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < nr_writers; ++i) {
+    threads.emplace_back(bench_write_fn, total_bytes / nr_writers, chunk_bytes);
+  }
+  // Waits for the writer.
+  int pipe_fd = open(bench_pipe_filename, O_RDONLY);
+  ASSERT_NE(-1, pipe_fd);
+
+  std::vector<char> buf(chunk_bytes);
+  size_t read_total = 0;
+  size_t nr_reads = 0;
+  while (read_total < total_bytes) {
+    ssize_t read_bytes = TEMP_FAILURE_RETRY(read(pipe_fd, buf.data(), buf.size()));
+    ASSERT_GT(read_bytes, 0);
+    read_total += read_bytes;
+    nr_reads++;
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+  ASSERT_EQ(0, close(pipe_fd));
+  printf("writers %2zu, chunk %6zu: %8.1f MB/s, %5.1f bytes/read\n", nr_writers, chunk_bytes,
+         total_bytes / seconds.count() / 1e6, static_cast<double>(read_total) / nr_reads);
+}
+
+TEST(scull_pipe_dev, throughput) {
+  const size_t total_bytes = 64 << 20;
+  for (size_t chunk_bytes : {64, 512, 4096, 65536}) {
+    bench_pipe(total_bytes, chunk_bytes);
+  }
+}
+
+// Load scull_pipe with pipe_percpu=1 to compare writer scaling.
+TEST(scull_pipe_dev, throughput_writers) {
+  const size_t total_bytes = 64 << 20;
+  for (size_t nr_writers : {1, 2, 4, 8}) {
+    bench_pipe(total_bytes, 4096, nr_writers);
+  }
+}
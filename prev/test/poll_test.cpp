@@ -1,10 +1,18 @@
 #include <gtest/gtest.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/time.h>
 
+#include <fstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 const char* pipe_filename = "../scull_pipe_dev";
 
@@ -70,3 +78,448 @@ TEST(scull_pipe_dev, select) {
 
   thread.join();
 }
+
+#define SCULL_IOC_MAGIC 'z'
+enum {
+  SCULL_PIPE_IOC_NR_FIRST = 0x90,
+  SCULL_PIPE_IOC_NR_GET_PACKET = SCULL_PIPE_IOC_NR_FIRST,
+  SCULL_PIPE_IOC_NR_SET_PACKET,
+  SCULL_PIPE_IOC_NR_RECV_BATCH,
+  SCULL_PIPE_IOC_NR_GET_BUFSIZE,
+  SCULL_PIPE_IOC_NR_SET_BUFSIZE,
+  SCULL_PIPE_IOC_NR_DOORBELL,
+  SCULL_PIPE_IOC_NR_SET_RCVLOWAT,
+  SCULL_PIPE_IOC_NR_SET_SNDLOWAT,
+  SCULL_PIPE_IOC_NR_SET_RCVTIMEO,
+  SCULL_PIPE_IOC_NR_GET_STATS,
+  SCULL_PIPE_IOC_NR_SET_BUSY_POLL,
+  SCULL_PIPE_IOC_NR_LAST,
+};
+
+struct scull_pipe_msg {
+  __u64 buf;
+  __u32 len;
+  __u32 flags;
+};
+
+struct scull_pipe_batch {
+  __u64 msgs;
+  __u32 nr;
+  __u32 reserved;
+};
+
+#define SCULL_PIPE_MSG_TRUNC 1
+
+struct scull_pipe_stats {
+  __u64 bytes_read;
+  __u64 nr_reads;
+  __u64 bytes_written;
+  __u64 nr_writes;
+};
+
+#define SCULL_IOC_GET_PACKET  _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_GET_PACKET)
+#define SCULL_IOC_SET_PACKET  _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_SET_PACKET)
+#define SCULL_IOC_RECV_BATCH  _IOWR(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_RECV_BATCH, struct scull_pipe_batch)
+#define SCULL_IOC_GET_BUFSIZE _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_GET_BUFSIZE)
+#define SCULL_IOC_SET_BUFSIZE _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_SET_BUFSIZE)
+#define SCULL_IOC_DOORBELL    _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_DOORBELL)
+#define SCULL_IOC_SET_RCVLOWAT _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_SET_RCVLOWAT)
+#define SCULL_IOC_SET_SNDLOWAT _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_SET_SNDLOWAT)
+#define SCULL_IOC_SET_RCVTIMEO _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_SET_RCVTIMEO)
+#define SCULL_IOC_GET_STATS    _IOR(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_GET_STATS, struct scull_pipe_stats)
+#define SCULL_IOC_SET_BUSY_POLL _IO(SCULL_IOC_MAGIC, SCULL_PIPE_IOC_NR_SET_BUSY_POLL)
+
+struct scull_pipe_ctrl {
+  __u32 write_pos;
+  __u32 pad0[15];
+  __u32 read_pos;
+  __u32 pad1[15];
+  __u32 bufsize;
+  __u32 flags;
+};
+
+TEST(scull_pipe_dev, packet) {
+  int read_fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
+  ASSERT_NE(-1, read_fd);
+  ASSERT_EQ(0, ioctl(read_fd, SCULL_IOC_SET_PACKET, 1));
+  ASSERT_EQ(1, ioctl(read_fd, SCULL_IOC_GET_PACKET));
+
+  int write_fd = open(pipe_filename, O_WRONLY);
+  ASSERT_NE(-1, write_fd);
+  // The mode can't change with a writer.
+  ASSERT_EQ(-1, ioctl(read_fd, SCULL_IOC_SET_PACKET, 0));
+  ASSERT_EQ(EBUSY, errno);
+  const std::string records[] = {"first", "second record", "3", "fourth, to be truncated"};
+  for (const std::string& record : records) {
+    ASSERT_EQ(static_cast<ssize_t>(record.size()), write(write_fd, record.data(), record.size()));
+  }
+
+  // An empty read leaves the record queued.
+  char buf[64];
+  ASSERT_EQ(0, read(read_fd, buf, 0));
+  // One record per read.
+  ASSERT_EQ(5, read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ(records[0], std::string(buf, 5));
+
+  // The rest with one call.
+  char bufs[3][8];
+  scull_pipe_msg msgs[4];
+  for (int i = 0; i < 4; ++i) {
+    msgs[i].buf = reinterpret_cast<__u64>(bufs[i % 3]);
+    msgs[i].len = sizeof(bufs[0]);
+  }
+  scull_pipe_batch batch = {reinterpret_cast<__u64>(msgs), 4, 0};
+  ASSERT_EQ(0, ioctl(read_fd, SCULL_IOC_RECV_BATCH, &batch));
+  ASSERT_EQ(3u, batch.nr);
+  ASSERT_EQ(records[1].size(), msgs[0].len);
+  ASSERT_EQ(static_cast<__u32>(SCULL_PIPE_MSG_TRUNC), msgs[0].flags);
+  ASSERT_EQ(records[1].substr(0, 8), std::string(bufs[0], 8));
+  ASSERT_EQ(1u, msgs[1].len);
+  ASSERT_EQ(0u, msgs[1].flags);
+  ASSERT_EQ('3', bufs[1][0]);
+  ASSERT_EQ(records[3].size(), msgs[2].len);
+
+  ASSERT_EQ(0, close(write_fd));
+  ASSERT_EQ(1, ioctl(read_fd, SCULL_IOC_SET_PACKET, 0));
+  ASSERT_EQ(0, close(read_fd));
+}
+
+TEST(scull_pipe_dev, resize) {
+  const long page_size = sysconf(_SC_PAGESIZE);
+  int read_fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
+  ASSERT_NE(-1, read_fd);
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  long old_size = ioctl(read_fd, SCULL_IOC_GET_BUFSIZE);
+  ASSERT_GE(old_size, page_size);
+
+  std::vector<char> data(page_size / 2);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 7;
+  }
+  ASSERT_EQ(static_cast<ssize_t>(data.size()), write(write_fd, data.data(), data.size()));
+
+  // Grow with data buffered, rounded up to a power of two pages.
+  ASSERT_EQ(8 * page_size, ioctl(read_fd, SCULL_IOC_SET_BUFSIZE, 5 * page_size));
+  ASSERT_EQ(8 * page_size, ioctl(read_fd, SCULL_IOC_GET_BUFSIZE));
+  std::vector<char> more(2 * page_size, 'm');
+  ASSERT_EQ(static_cast<ssize_t>(more.size()), write(write_fd, more.data(), more.size()));
+
+  // The data doesn't fit in one page.
+  ASSERT_EQ(-1, ioctl(read_fd, SCULL_IOC_SET_BUFSIZE, page_size));
+  ASSERT_EQ(EBUSY, errno);
+
+  std::vector<char> buf(data.size());
+  ASSERT_EQ(static_cast<ssize_t>(buf.size()), read(read_fd, buf.data(), buf.size()));
+  ASSERT_EQ(data, buf);
+  buf.resize(more.size());
+  ASSERT_EQ(static_cast<ssize_t>(buf.size()), read(read_fd, buf.data(), buf.size()));
+  ASSERT_EQ(more, buf);
+
+  ASSERT_EQ(old_size, ioctl(read_fd, SCULL_IOC_SET_BUFSIZE, old_size));
+  ASSERT_EQ(0, close(write_fd));
+  ASSERT_EQ(0, close(read_fd));
+}
+
+TEST(scull_pipe_dev, splice) {
+  const long page_size = sysconf(_SC_PAGESIZE);
+  int read_fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
+  ASSERT_NE(-1, read_fd);
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  int in_pipe[2], out_pipe[2];
+  ASSERT_EQ(0, pipe(in_pipe));
+  ASSERT_EQ(0, pipe(out_pipe));
+
+  // Whole pages and a partial one.
+  std::vector<char> data(page_size + 100);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 13;
+  }
+  ASSERT_EQ(static_cast<ssize_t>(data.size()), write(in_pipe[1], data.data(), data.size()));
+  ASSERT_EQ(static_cast<ssize_t>(data.size()), splice(in_pipe[0], NULL, write_fd, NULL, data.size(), 0));
+  ASSERT_EQ(static_cast<ssize_t>(data.size()), splice(read_fd, NULL, out_pipe[1], NULL, data.size(), 0));
+
+  std::vector<char> buf(data.size());
+  ASSERT_EQ(static_cast<ssize_t>(buf.size()), read(out_pipe[0], buf.data(), buf.size()));
+  ASSERT_EQ(data, buf);
+  ASSERT_EQ(-1, splice(read_fd, NULL, out_pipe[1], NULL, data.size(), SPLICE_F_NONBLOCK));
+  ASSERT_EQ(EAGAIN, errno);
+
+  for (int fd : {in_pipe[0], in_pipe[1], out_pipe[0], out_pipe[1], write_fd, read_fd}) {
+    ASSERT_EQ(0, close(fd));
+  }
+}
+
+TEST(scull_pipe_dev, watermarks) {
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  int read_fd = open(pipe_filename, O_RDONLY);
+  ASSERT_NE(-1, read_fd);
+  ASSERT_EQ(1, ioctl(read_fd, SCULL_IOC_SET_RCVLOWAT, 8));
+  ASSERT_EQ(0, ioctl(read_fd, SCULL_IOC_SET_RCVTIMEO, 100));
+  long bufsize = ioctl(write_fd, SCULL_IOC_GET_BUFSIZE);
+  ASSERT_EQ(1, ioctl(write_fd, SCULL_IOC_SET_SNDLOWAT, bufsize / 2));
+
+  // Not readable below the low watermark.
+  ASSERT_EQ(4, write(write_fd, "abcd", 4));
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(read_fd, &readfds);
+  timeval timeout = {0, 0};
+  ASSERT_EQ(0, select(read_fd + 1, &readfds, NULL, NULL, &timeout));
+  ASSERT_EQ(4, write(write_fd, "efgh", 4));
+  FD_SET(read_fd, &readfds);
+  ASSERT_EQ(1, select(read_fd + 1, &readfds, NULL, NULL, &timeout));
+  char buf[16];
+  ASSERT_EQ(8, read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ("abcdefgh", std::string(buf, 8));
+
+  // The timeout returns what is there, or EAGAIN with nothing.
+  ASSERT_EQ(2, write(write_fd, "ij", 2));
+  ASSERT_EQ(2, read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ(-1, read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ(EAGAIN, errno);
+
+  // Not writable with less than the writer's low watermark free.
+  std::vector<char> fill(bufsize - 1, 'f');
+  ASSERT_EQ(static_cast<ssize_t>(fill.size()), write(write_fd, fill.data(), fill.size()));
+  fd_set writefds;
+  FD_ZERO(&writefds);
+  FD_SET(write_fd, &writefds);
+  ASSERT_EQ(0, select(write_fd + 1, NULL, &writefds, NULL, &timeout));
+  std::vector<char> drain(bufsize);
+  ASSERT_EQ(static_cast<ssize_t>(fill.size()), read(read_fd, drain.data(), drain.size()));
+  FD_SET(write_fd, &writefds);
+  ASSERT_EQ(1, select(write_fd + 1, NULL, &writefds, NULL, &timeout));
+
+  // A full ring is readable past any low watermark.
+  ASSERT_EQ(8, ioctl(read_fd, SCULL_IOC_SET_RCVLOWAT, 2 * bufsize));
+  fill.assign(bufsize, 'g');
+  ASSERT_EQ(bufsize, write(write_fd, fill.data(), fill.size()));
+  FD_SET(read_fd, &readfds);
+  ASSERT_EQ(1, select(read_fd + 1, &readfds, NULL, NULL, &timeout));
+  ASSERT_EQ(bufsize, read(read_fd, drain.data(), drain.size()));
+
+  ASSERT_EQ(0, close(write_fd));
+  ASSERT_EQ(0, close(read_fd));
+}
+
+TEST(scull_pipe_dev, stats) {
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  int read_fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
+  ASSERT_NE(-1, read_fd);
+  scull_pipe_stats before, after;
+  ASSERT_EQ(0, ioctl(read_fd, SCULL_IOC_GET_STATS, &before));
+
+  ASSERT_EQ(3, write(write_fd, "abc", 3));
+  ASSERT_EQ(2, write(write_fd, "de", 2));
+  char buf[8];
+  ASSERT_EQ(5, read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ(0, ioctl(write_fd, SCULL_IOC_GET_STATS, &after));
+  ASSERT_EQ(before.bytes_written + 5, after.bytes_written);
+  ASSERT_EQ(before.nr_writes + 2, after.nr_writes);
+  ASSERT_EQ(before.bytes_read + 5, after.bytes_read);
+  ASSERT_EQ(before.nr_reads + 1, after.nr_reads);
+
+  ASSERT_EQ(0, close(write_fd));
+  ASSERT_EQ(0, close(read_fd));
+}
+
+// A write to a parked reader is copied straight to it, and counted once on
+// each side.
+TEST(scull_pipe_dev, handoff) {
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  int read_fd = open(pipe_filename, O_RDONLY);
+  ASSERT_NE(-1, read_fd);
+  scull_pipe_stats before, after;
+  ASSERT_EQ(0, ioctl(read_fd, SCULL_IOC_GET_STATS, &before));
+
+  const std::string request = "request";
+  std::thread reader([read_fd, &request] {
+    char buf[64];
+    ASSERT_EQ(static_cast<ssize_t>(request.size()), read(read_fd, buf, sizeof(buf)));
+    ASSERT_EQ(request, std::string(buf, request.size()));
+  });
+  ASSERT_EQ(0, usleep(100000));
+  ASSERT_EQ(static_cast<ssize_t>(request.size()), write(write_fd, request.data(), request.size()));
+  reader.join();
+
+  ASSERT_EQ(0, ioctl(read_fd, SCULL_IOC_GET_STATS, &after));
+  ASSERT_EQ(before.bytes_written + request.size(), after.bytes_written);
+  ASSERT_EQ(before.bytes_read + request.size(), after.bytes_read);
+  ASSERT_EQ(before.nr_reads + 1, after.nr_reads);
+  char c;
+  ASSERT_EQ(0, close(write_fd));
+  ASSERT_EQ(0, read(read_fd, &c, 1));
+  ASSERT_EQ(0, close(read_fd));
+}
+
+// Ping-pong with the scull_pipe side read by a busy polling reader.
+TEST(scull_pipe_dev, busy_poll) {
+  const int rounds = 1000;
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  int read_fd = open(pipe_filename, O_RDONLY);
+  ASSERT_NE(-1, read_fd);
+  long old_busy_poll = ioctl(read_fd, SCULL_IOC_SET_BUSY_POLL, 50);
+  ASSERT_GE(old_busy_poll, 0);
+  ASSERT_EQ(50, ioctl(read_fd, SCULL_IOC_SET_BUSY_POLL, 50));
+
+  int pong[2];
+  ASSERT_EQ(0, pipe(pong));
+  std::thread echo([read_fd, &pong] {
+    char c;
+    for (int i = 0; i < rounds; ++i) {
+      ASSERT_EQ(1, read(read_fd, &c, 1));
+      ASSERT_EQ(1, write(pong[1], &c, 1));
+    }
+  });
+  for (int i = 0; i < rounds; ++i) {
+    char c = i;
+    ASSERT_EQ(1, write(write_fd, &c, 1));
+    ASSERT_EQ(1, read(pong[0], &c, 1));
+    ASSERT_EQ(static_cast<char>(i), c);
+  }
+  echo.join();
+
+  for (int fd : {pong[0], pong[1], read_fd, write_fd}) {
+    ASSERT_EQ(0, close(fd));
+  }
+}
+
+TEST(scull_pipe_dev, epoll) {
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  int read_fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
+  ASSERT_NE(-1, read_fd);
+
+  // Edge-triggered: one event per write, even while readable.
+  int et_fd = epoll_create1(0);
+  ASSERT_NE(-1, et_fd);
+  epoll_event event = {};
+  event.events = EPOLLIN | EPOLLET;
+  ASSERT_EQ(0, epoll_ctl(et_fd, EPOLL_CTL_ADD, read_fd, &event));
+  // Exclusive, with a writer entry that must not take the reader's wakeups.
+  int excl_fd = epoll_create1(0);
+  ASSERT_NE(-1, excl_fd);
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ASSERT_EQ(0, epoll_ctl(excl_fd, EPOLL_CTL_ADD, read_fd, &event));
+  event.events = EPOLLOUT | EPOLLEXCLUSIVE;
+  ASSERT_EQ(0, epoll_ctl(excl_fd, EPOLL_CTL_ADD, write_fd, &event));
+
+  epoll_event events[2];
+  ASSERT_EQ(0, epoll_wait(et_fd, events, 2, 0));
+  ASSERT_EQ(1, write(write_fd, "a", 1));
+  ASSERT_EQ(1, epoll_wait(et_fd, events, 2, 0));
+  ASSERT_EQ(0, epoll_wait(et_fd, events, 2, 0));
+  ASSERT_EQ(1, write(write_fd, "b", 1));
+  ASSERT_EQ(1, epoll_wait(et_fd, events, 2, 0));
+  ASSERT_EQ(static_cast<uint32_t>(EPOLLIN), events[0].events);
+
+  ASSERT_EQ(2, epoll_wait(excl_fd, events, 2, 0));
+  char buf[4];
+  ASSERT_EQ(2, read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ(1, epoll_wait(excl_fd, events, 2, 0));
+  ASSERT_EQ(static_cast<uint32_t>(EPOLLOUT), events[0].events);
+
+  for (int fd : {excl_fd, et_fd, read_fd, write_fd}) {
+    ASSERT_EQ(0, close(fd));
+  }
+}
+
+// Needs scull_pipe loaded with pipe_fanout=1.
+TEST(scull_pipe_dev, fanout) {
+  unsigned fanout = 0;
+  std::ifstream("/sys/module/scull_pipe/parameters/pipe_fanout") >> fanout;
+  if (fanout != 1) {
+    return;
+  }
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  int read_fds[3];
+  for (int& read_fd : read_fds) {
+    read_fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
+    ASSERT_NE(-1, read_fd);
+  }
+  long bufsize = ioctl(write_fd, SCULL_IOC_GET_BUFSIZE);
+
+  // Every reader gets every byte.
+  ASSERT_EQ(5, write(write_fd, "hello", 5));
+  char buf[8];
+  for (int read_fd : read_fds) {
+    ASSERT_EQ(5, read(read_fd, buf, sizeof(buf)));
+    ASSERT_EQ("hello", std::string(buf, 5));
+    ASSERT_EQ(-1, read(read_fd, buf, sizeof(buf)));
+    ASSERT_EQ(EAGAIN, errno);
+  }
+
+  // Space is only reclaimed past the slowest reader.
+  std::vector<char> fill(bufsize, 'f');
+  ASSERT_EQ(bufsize, write(write_fd, fill.data(), fill.size()));
+  std::vector<char> drain(bufsize);
+  ASSERT_EQ(bufsize, read(read_fds[0], drain.data(), drain.size()));
+  ASSERT_EQ(bufsize, read(read_fds[1], drain.data(), drain.size()));
+  ASSERT_EQ(-1, write(write_fd, "x", 1));
+  ASSERT_EQ(EAGAIN, errno);
+  ASSERT_EQ(bufsize, read(read_fds[2], drain.data(), drain.size()));
+  ASSERT_EQ(1, write(write_fd, "x", 1));
+  for (int read_fd : read_fds) {
+    ASSERT_EQ(1, read(read_fd, buf, sizeof(buf)));
+  }
+
+  for (int fd : {read_fds[0], read_fds[1], read_fds[2], write_fd}) {
+    ASSERT_EQ(0, close(fd));
+  }
+}
+
+// Needs scull_pipe loaded with pipe_mmap=1.
+TEST(scull_pipe_dev, mmap) {
+  const long page_size = sysconf(_SC_PAGESIZE);
+  int map_fd = open(pipe_filename, O_RDWR | O_NONBLOCK);
+  if (map_fd == -1 && errno == EINVAL) {
+    return;
+  }
+  ASSERT_NE(-1, map_fd);
+  long bufsize = ioctl(map_fd, SCULL_IOC_GET_BUFSIZE);
+  ASSERT_GE(bufsize, page_size);
+  void* p = mmap(NULL, page_size + bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+  ASSERT_NE(MAP_FAILED, p);
+  scull_pipe_ctrl* ctrl = static_cast<scull_pipe_ctrl*>(p);
+  char* data = static_cast<char*>(p) + page_size;
+  ASSERT_EQ(static_cast<__u32>(bufsize), ctrl->bufsize);
+
+  // Produce from the mapping, consume with read().
+  int read_fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
+  ASSERT_NE(-1, read_fd);
+  const std::string message = "through the mapping";
+  __u32 write_pos = __atomic_load_n(&ctrl->write_pos, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < message.size(); ++i) {
+    data[(write_pos + i) & (bufsize - 1)] = message[i];
+  }
+  __atomic_store_n(&ctrl->write_pos, write_pos + message.size(), __ATOMIC_RELEASE);
+  ASSERT_EQ(0, ioctl(map_fd, SCULL_IOC_DOORBELL));
+  char buf[64];
+  ASSERT_EQ(static_cast<ssize_t>(message.size()), read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ(message, std::string(buf, message.size()));
+
+  // Produce with write(), consume from the mapping.
+  int write_fd = open(pipe_filename, O_WRONLY | O_NONBLOCK);
+  ASSERT_NE(-1, write_fd);
+  ASSERT_EQ(static_cast<ssize_t>(message.size()), write(write_fd, message.data(), message.size()));
+  __u32 read_pos = __atomic_load_n(&ctrl->read_pos, __ATOMIC_RELAXED);
+  ASSERT_EQ(message.size(), __atomic_load_n(&ctrl->write_pos, __ATOMIC_ACQUIRE) - read_pos);
+  for (size_t i = 0; i < message.size(); ++i) {
+    ASSERT_EQ(message[i], data[(read_pos + i) & (bufsize - 1)]);
+  }
+  __atomic_store_n(&ctrl->read_pos, read_pos + message.size(), __ATOMIC_RELEASE);
+  ASSERT_EQ(-1, read(read_fd, buf, sizeof(buf)));
+  ASSERT_EQ(EAGAIN, errno);
+
+  ASSERT_EQ(0, munmap(p, page_size + bufsize));
+  for (int fd : {write_fd, read_fd, map_fd}) {
+    ASSERT_EQ(0, close(fd));
+  }
+}